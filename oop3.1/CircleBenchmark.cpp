@@ -0,0 +1,468 @@
+// Бенчмарки CircleStorage и отрисовки CircleWidget. Собирается вместе
+// с CircleWidget.cpp и -DCIRCLE_BENCHMARK, работает на платформе offscreen
+// и пишет JSON в формате Google Benchmark:
+//
+//   CircleBenchmark [--counts=10000,1000000,10000000]
+//                   [--frame-counts=100000,1000000] [--io-counts=10000000]
+//                   [--delete-counts=1000000] [--out=results.json]
+
+#include "CircleWidget.h"
+#include <QApplication>
+#include <QTemporaryDir>
+#include <QEventLoop>
+#include <QFileInfo>
+#include <chrono>
+#include <random>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#ifdef __linux__
+#include <unistd.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+namespace {
+
+const int FIELD_WIDTH = 1920;
+const int FIELD_HEIGHT = 1080;
+const int FRAME_ITERATIONS = 10;
+
+struct Result {
+    std::string name;
+    double milliseconds;
+    std::vector<std::pair<std::string, double>> counters;
+};
+
+double elapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Резидентная память процесса, 0 если её не узнать
+size_t residentBytes() {
+#ifdef __linux__
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    if (statm >> pages >> resident) {
+        return resident * size_t(sysconf(_SC_PAGESIZE));
+    }
+#endif
+    return 0;
+}
+
+// Возвращаем освобождённую кучу системе, чтобы замеры памяти не влияли друг на друга
+void releaseFreedMemory() {
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
+
+// Детерминированная сцена из count кругов
+template <typename Add>
+void populate(size_t count, Add add) {
+    std::mt19937 random(1);
+    std::uniform_int_distribution<int> xs(0, FIELD_WIDTH - 1);
+    std::uniform_int_distribution<int> ys(0, FIELD_HEIGHT - 1);
+    for (size_t i = 0; i < count; ++i) {
+        int x = xs(random);
+        add(x, ys(random));
+    }
+}
+
+void populate(CircleStorage& storage, size_t count) {
+    populate(count, [&](int x, int y) { storage.addCircle(x, y); });
+}
+
+// Прежнее устройство хранилища: круги в куче за shared_ptr и та же сетка
+// индексов. Нужно только как точка отсчёта для замеров
+struct PointerStorage {
+    std::vector<std::shared_ptr<Circle>> circles;
+    std::unordered_map<uint64_t, std::vector<uint32_t>> grid;
+
+    static uint64_t cellKey(int x, int y) {
+        // Координаты сцены неотрицательны, деления хватает
+        return (uint64_t(uint32_t(x / CircleStorage::CELL_SIZE)) << 32) | uint32_t(y / CircleStorage::CELL_SIZE);
+    }
+    void add(int x, int y) {
+        circles.push_back(std::make_shared<Circle>(x, y));
+        grid[cellKey(x, y)].push_back(uint32_t(circles.size() - 1));
+    }
+    void removeSelected() {
+        auto it = std::remove_if(circles.begin(), circles.end(),
+            [](const std::shared_ptr<Circle>& circle) { return circle->isSelected(); });
+        if (it == circles.end()) return;
+        circles.erase(it, circles.end());
+        grid.clear();
+        for (size_t i = 0; i < circles.size(); ++i) {
+            grid[cellKey(circles[i]->getX(), circles[i]->getY())].push_back(uint32_t(i));
+        }
+    }
+};
+
+// Память на круг и время удаления половины кругов: хранилище по значению
+// против прежнего на shared_ptr
+void benchmarkStorage(size_t count, std::vector<Result>& results) {
+    std::string suffix = "/" + std::to_string(count);
+    auto memoryResult = [&](const std::string& name, size_t before, size_t after) {
+        Result memory = { name + suffix, 0.0, {} };
+        if (before && after > before) memory.counters.push_back({ "bytes_per_circle", double(after - before) / double(count) });
+        results.push_back(memory);
+    };
+
+    {
+        releaseFreedMemory();
+        size_t before = residentBytes();
+        CircleStorage storage;
+        populate(storage, count);
+        memoryResult("memory_per_circle_value", before, residentBytes());
+
+        for (size_t i = 0; i < storage.size(); i += 2) storage.setSelected(i, true);
+        auto start = std::chrono::steady_clock::now();
+        size_t removed = storage.removeSelected();
+        results.push_back({ "remove_selected_value" + suffix, elapsedMs(start), { { "removed", double(removed) } } });
+    }
+    {
+        releaseFreedMemory();
+        size_t before = residentBytes();
+        PointerStorage storage;
+        populate(count, [&](int x, int y) { storage.add(x, y); });
+        memoryResult("memory_per_circle_shared_ptr", before, residentBytes());
+
+        for (size_t i = 0; i < storage.circles.size(); i += 2) storage.circles[i]->setSelected(true);
+        size_t total = storage.circles.size();
+        auto start = std::chrono::steady_clock::now();
+        storage.removeSelected();
+        results.push_back({ "remove_selected_shared_ptr" + suffix, elapsedMs(start),
+            { { "removed", double(total - storage.circles.size()) } } });
+    }
+    releaseFreedMemory();
+}
+
+std::vector<QPoint> randomClicks(size_t count) {
+    std::mt19937 random(2);
+    std::uniform_int_distribution<int> xs(0, FIELD_WIDTH - 1);
+    std::uniform_int_distribution<int> ys(0, FIELD_HEIGHT - 1);
+    std::vector<QPoint> clicks(count);
+    for (QPoint& click : clicks) click = QPoint(xs(random), ys(random));
+    return clicks;
+}
+
+// Клики в секунду через сетку и, для сравнения, полным перебором
+void benchmarkClicks(const CircleStorage& storage, size_t count, std::vector<Result>& results) {
+    std::string suffix = "/" + std::to_string(count);
+    std::vector<QPoint> clicks = randomClicks(1000);
+    std::vector<size_t> hits;
+    size_t found = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (const QPoint& click : clicks) {
+        storage.circlesAt(click.x(), click.y(), hits);
+        found += hits.size();
+    }
+    double gridMs = elapsedMs(start);
+    results.push_back({ "click_grid" + suffix, gridMs / clicks.size(),
+        { { "clicks_per_second", clicks.size() * 1000.0 / gridMs }, { "hits_per_click", double(found) / clicks.size() } } });
+
+    // Перебор медленный, на больших сценах хватает нескольких кликов
+    size_t scanClicks = std::max<size_t>(1, std::min<size_t>(clicks.size(), 100000000 / std::max<size_t>(count, 1)));
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < scanClicks; ++i) {
+        hits.clear();
+        for (size_t index = 0; index < storage.size(); ++index) {
+            if (storage.circleAt(index).contains(clicks[i].x(), clicks[i].y())) hits.push_back(index);
+        }
+    }
+    double scanMs = elapsedMs(start);
+    results.push_back({ "click_linear_scan" + suffix, scanMs / scanClicks,
+        { { "clicks_per_second", scanClicks * 1000.0 / scanMs } } });
+}
+
+// Время кадра на полном поле в обоих режимах отрисовки; выделен каждый десятый круг
+void benchmarkFrames(size_t count, std::vector<Result>& results) {
+    std::string suffix = "/" + std::to_string(count);
+    CircleWidget widget;
+    widget.resize(FIELD_WIDTH, FIELD_HEIGHT);
+    widget.show();
+    QCoreApplication::processEvents();
+
+    CircleStorage& storage = widget.getStorage();
+    populate(storage, count);
+    for (size_t i = 0; i < storage.size(); i += 10) storage.setSelected(i, true);
+
+    const std::pair<const char*, CircleWidget::RenderMode> modes[] = {
+        { "frame_ellipses", CircleWidget::RenderMode::Ellipses },
+        { "frame_sprites", CircleWidget::RenderMode::Sprites },
+    };
+    for (const auto& [name, mode] : modes) {
+        widget.setRenderMode(mode);
+        // Первый кадр строит спрайты и прогревает кэши, в замер не входит
+        widget.repaint();
+        QCoreApplication::processEvents();
+
+        std::vector<double> frames;
+        for (int i = 0; i < FRAME_ITERATIONS; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            widget.repaint();
+            frames.push_back(elapsedMs(start));
+            QCoreApplication::processEvents();
+        }
+        std::sort(frames.begin(), frames.end());
+        double mean = 0.0;
+        for (double frame : frames) mean += frame;
+        mean /= frames.size();
+        results.push_back({ name + suffix, mean,
+            { { "min_ms", frames.front() }, { "max_ms", frames.back() }, { "fps", 1000.0 / mean } } });
+    }
+}
+
+// Сохранение, загрузка из кэша страниц (синхронно и через CircleLoader)
+// и импорт CSV; выделен каждый десятый круг
+void benchmarkFiles(size_t count, std::vector<Result>& results) {
+    std::string suffix = "/" + std::to_string(count);
+    QTemporaryDir dir;
+    if (!dir.isValid()) {
+        std::cerr << "Cannot create a temporary directory\n";
+        return;
+    }
+    QString binaryPath = dir.filePath("circles.circles");
+    QString csvPath = dir.filePath("circles.csv");
+    QString error;
+
+    {
+        CircleStorage storage;
+        populate(storage, count);
+        for (size_t i = 0; i < storage.size(); i += 10) storage.setSelected(i, true);
+
+        auto start = std::chrono::steady_clock::now();
+        if (!saveCircles(storage, binaryPath, error)) {
+            std::cerr << "Cannot save: " << error.toStdString() << "\n";
+            return;
+        }
+        double saveMs = elapsedMs(start);
+        double bytes = double(QFileInfo(binaryPath).size());
+        results.push_back({ "save_binary" + suffix, saveMs, { { "bytes_per_circle", bytes / count } } });
+
+        // CSV пишется генератором и в замер не входит
+        std::ofstream csv(csvPath.toStdString());
+        csv << "x,y,selected\n";
+        for (size_t i = 0; i < storage.size(); ++i) {
+            csv << storage.getX(i) << ',' << storage.getY(i) << ',' << (storage.isSelected(i) ? 1 : 0) << '\n';
+        }
+    }
+    releaseFreedMemory();
+
+    auto loadResult = [&](const std::string& name, double ms, const CircleStorage& storage) {
+        results.push_back({ name + suffix, ms,
+            { { "circles_per_second", storage.size() * 1000.0 / ms }, { "selected", double(storage.selectedCount()) } } });
+    };
+    {
+        CircleStorage storage;
+        BinaryCircleDecoder decoder(storage);
+        auto start = std::chrono::steady_clock::now();
+        if (!readCircles(binaryPath, decoder, error)) {
+            std::cerr << "Cannot load: " << error.toStdString() << "\n";
+            return;
+        }
+        loadResult("load_binary", elapsedMs(start), storage);
+    }
+    releaseFreedMemory();
+    {
+        CircleStorage storage;
+        CircleLoader loader(binaryPath, std::make_unique<BinaryCircleDecoder>(storage));
+        QEventLoop loop;
+        int steps = 0;
+        bool done = false;
+        // Самый долгий шаг загрузчика, то есть самая долгая пауза в отрисовке
+        auto stepStart = std::chrono::steady_clock::now();
+        double longestStep = 0;
+        auto endStep = [&]() {
+            longestStep = std::max(longestStep, elapsedMs(stepStart));
+            stepStart = std::chrono::steady_clock::now();
+        };
+        QObject::connect(&loader, &CircleLoader::progress, [&](qint64, qint64) {
+            ++steps;
+            endStep();
+        });
+        QObject::connect(&loader, &CircleLoader::finished, [&](bool, const QString&) {
+            endStep();
+            done = true;
+            loop.quit();
+        });
+        auto start = std::chrono::steady_clock::now();
+        stepStart = start;
+        loader.start();
+        if (!done) loop.exec();
+        double ms = elapsedMs(start);
+        loadResult("load_binary_async", ms, storage);
+        results.back().counters.push_back({ "event_loop_steps", double(steps) });
+        results.back().counters.push_back({ "longest_step_ms", longestStep });
+    }
+    releaseFreedMemory();
+    {
+        CircleStorage storage;
+        CsvCircleDecoder decoder(storage);
+        auto start = std::chrono::steady_clock::now();
+        if (!readCircles(csvPath, decoder, error)) {
+            std::cerr << "Cannot import: " << error.toStdString() << "\n";
+            return;
+        }
+        loadResult("import_csv", elapsedMs(start), storage);
+    }
+    releaseFreedMemory();
+}
+
+// Удаление count выделенных кругов из 2 * count: прежний путь со строкой
+// на каждый круг против сводки, с журналом и без
+void benchmarkDelete(size_t count, std::vector<Result>& results) {
+    std::string suffix = "/" + std::to_string(count);
+    QTemporaryDir dir;
+    QString logPath = dir.filePath("deleted.csv");
+
+    auto prepare = [&](CircleWidget& widget) {
+        CircleStorage& storage = widget.getStorage();
+        populate(storage, count * 2);
+        for (size_t i = 0; i < storage.size(); i += 2) storage.setSelected(i, true);
+    };
+    auto deleteResult = [&](const std::string& name, double ms, CircleWidget& widget) {
+        results.push_back({ name + suffix, ms, { { "remaining", double(widget.getStorage().size()) } } });
+    };
+
+    {
+        CircleWidget widget;
+        prepare(widget);
+        CircleStorage& storage = widget.getStorage();
+        auto start = std::chrono::steady_clock::now();
+        // Прежний keyPressEvent: строка растёт на каждый выделенный круг
+        QString deletedInfo = "Circles with coordinates have been removed:\n";
+        for (size_t i = 0; i < storage.size(); ++i) {
+            if (storage.isSelected(i)) {
+                deletedInfo += QString("x: %1, y: %2\n").arg(storage.getX(i)).arg(storage.getY(i));
+            }
+        }
+        storage.removeSelected();
+        deleteResult("delete_string_per_circle", elapsedMs(start), widget);
+    }
+    releaseFreedMemory();
+
+    for (bool logged : { false, true }) {
+        CircleWidget widget;
+        prepare(widget);
+        if (logged) widget.setDeleteLogPath(logPath);
+        QKeyEvent press(QEvent::KeyPress, Qt::Key_Delete, Qt::NoModifier);
+        auto start = std::chrono::steady_clock::now();
+        QCoreApplication::sendEvent(&widget, &press);
+        double ms = elapsedMs(start);
+        deleteResult(logged ? "delete_summary_logged" : "delete_summary", ms, widget);
+        if (logged) {
+            widget.flushDeleteLog();
+            results.back().counters.push_back({ "log_written_ms", elapsedMs(start) });
+            results.back().counters.push_back({ "log_bytes", double(QFileInfo(logPath).size()) });
+        }
+        releaseFreedMemory();
+    }
+}
+
+// Экранирует кавычки и обратные слэши в строке JSON
+std::string escapeJson(const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+void writeJson(std::ostream& out, const std::vector<Result>& results) {
+    out << std::setprecision(6) << std::fixed;
+    out << "{\n  \"context\": {\n    \"qt_version\": \"" << qVersion() << "\"\n  },\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        out << "    {\n"
+            << "      \"name\": \"" << escapeJson(r.name) << "\",\n"
+            << "      \"run_type\": \"iteration\",\n"
+            << "      \"iterations\": 1,\n"
+            << "      \"real_time\": " << r.milliseconds << ",\n"
+            << "      \"cpu_time\": " << r.milliseconds << ",\n";
+        for (const auto& [counter, value] : r.counters) {
+            out << "      \"" << escapeJson(counter) << "\": " << value << ",\n";
+        }
+        out << "      \"time_unit\": \"ms\"\n"
+            << "    }" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+} // namespace
+
+std::vector<size_t> parseCounts(const QString& argument) {
+    std::vector<size_t> counts;
+    for (const QString& count : argument.section('=', 1).split(',', Qt::SkipEmptyParts)) {
+        counts.push_back(size_t(count.toULongLong()));
+    }
+    return counts;
+}
+
+int main(int argc, char* argv[]) {
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QApplication app(argc, argv);
+
+    std::vector<size_t> counts = { 10000, 1000000, 10000000 };
+    std::vector<size_t> frameCounts = { 100000, 1000000 };
+    std::vector<size_t> ioCounts = { 10000000 };
+    std::vector<size_t> deleteCounts = { 1000000 };
+    QString outPath;
+    for (const QString& argument : app.arguments().mid(1)) {
+        if (argument.startsWith("--counts=")) {
+            counts = parseCounts(argument);
+        }
+        else if (argument.startsWith("--frame-counts=")) {
+            frameCounts = parseCounts(argument);
+        }
+        else if (argument.startsWith("--io-counts=")) {
+            ioCounts = parseCounts(argument);
+        }
+        else if (argument.startsWith("--delete-counts=")) {
+            deleteCounts = parseCounts(argument);
+        }
+        else if (argument.startsWith("--out=")) {
+            outPath = argument.section('=', 1);
+        }
+    }
+
+    std::vector<Result> results;
+    for (size_t count : counts) {
+        std::cerr << "Running " << count << " circles\n";
+        benchmarkStorage(count, results);
+        CircleStorage storage;
+        populate(storage, count);
+        benchmarkClicks(storage, count, results);
+    }
+    for (size_t count : frameCounts) {
+        std::cerr << "Rendering " << count << " circles\n";
+        benchmarkFrames(count, results);
+    }
+    for (size_t count : ioCounts) {
+        std::cerr << "Loading " << count << " circles\n";
+        benchmarkFiles(count, results);
+    }
+    for (size_t count : deleteCounts) {
+        std::cerr << "Deleting " << count << " circles\n";
+        benchmarkDelete(count, results);
+    }
+
+    if (outPath.isEmpty()) {
+        writeJson(std::cout, results);
+        return 0;
+    }
+    std::ofstream file(outPath.toStdString());
+    if (!file) {
+        std::cerr << "Cannot write " << outPath.toStdString() << "\n";
+        return 1;
+    }
+    writeJson(file, results);
+    return 0;
+}
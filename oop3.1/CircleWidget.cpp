@@ -1,5 +1,14 @@
 #include "CircleWidget.h"
+#include <QSaveFile>
+#include <QElapsedTimer>
+#include <QFileDialog>
+#include <QMenuBar>
+#include <QAction>
 #include <sstream>
+#include <cstring>
+#include <climits>
+#include <string_view>
+#include <charconv>
 
 // Реализация класса Circle
 Circle::Circle(int x, int y) : x(x), y(y), selected(false) {
@@ -24,82 +33,616 @@ bool Circle::contains(int x, int y) const {
 }
 
 // Реализация CircleStorage
-void CircleStorage::addCircle(std::shared_ptr<Circle> circle) {
-    circles.push_back(circle);
+int CircleStorage::cellCoord(int value) {
+    // Деление с округлением вниз, чтобы отрицательные координаты не слипались с нулевой ячейкой
+    return value >= 0 ? value / CELL_SIZE : -((-value - 1) / CELL_SIZE) - 1;
+}
+
+uint64_t CircleStorage::cellKey(int cellX, int cellY) {
+    return (uint64_t(uint32_t(cellX)) << 32) | uint32_t(cellY);
+}
+
+void CircleStorage::insertIntoGrid(size_t index) {
+    grid[cellKey(cellCoord(xs[index]), cellCoord(ys[index]))].push_back(uint32_t(index));
+}
+
+void CircleStorage::rebuildGrid() {
+    grid.clear();
+    for (size_t i = 0; i < xs.size(); ++i) {
+        insertIntoGrid(i);
+    }
+}
+
+CircleId CircleStorage::addCircle(int x, int y) {
+    size_t index = xs.size();
+    CircleId id = CircleId(indices.size());
+    xs.push_back(x);
+    ys.push_back(y);
+    ids.push_back(id);
+    indices.push_back(uint32_t(index));
+    if ((index & 63) == 0) {
+        selection.push_back(0);
+    }
+    insertIntoGrid(index);
+    return id;
+}
+
+void CircleStorage::addCircles(const int* x, const int* y, size_t count) {
+    size_t first = xs.size();
+    xs.insert(xs.end(), x, x + count);
+    ys.insert(ys.end(), y, y + count);
+    selection.resize((first + count + 63) / 64, 0);
+    for (size_t i = 0; i < count; ++i) {
+        ids.push_back(CircleId(indices.size()));
+        indices.push_back(uint32_t(first + i));
+        insertIntoGrid(first + i);
+    }
+}
+
+CircleId CircleStorage::addCircle(const Circle& circle) {
+    CircleId id = addCircle(circle.getX(), circle.getY());
+    setSelected(xs.size() - 1, circle.isSelected());
+    return id;
+}
+
+void CircleStorage::reserve(size_t count) {
+    if (count > xs.size()) {
+        indices.reserve(indices.size() + (count - xs.size()));
+    }
+    xs.reserve(count);
+    ys.reserve(count);
+    ids.reserve(count);
+    selection.reserve((count + 63) / 64);
+}
+
+void CircleStorage::clear() {
+    // Выданные id остаются недействительными, новые круги получают следующие
+    for (CircleId id : ids) {
+        indices[id] = REMOVED;
+    }
+    xs.clear();
+    ys.clear();
+    ids.clear();
+    selection.clear();
+    grid.clear();
+}
+
+Circle CircleStorage::circleAt(size_t index) const {
+    Circle circle(xs[index], ys[index]);
+    circle.setSelected(isSelected(index));
+    return circle;
+}
+
+std::vector<std::shared_ptr<Circle>> CircleStorage::getCircles() const {
+    std::vector<std::shared_ptr<Circle>> circles;
+    circles.reserve(size());
+    for (size_t index = 0; index < size(); ++index) {
+        circles.push_back(std::make_shared<Circle>(circleAt(index)));
+    }
+    return circles;
+}
+
+size_t CircleStorage::selectedCount() const {
+    size_t count = 0;
+    for (uint64_t word : selection) {
+        for (; word; word &= word - 1) ++count;
+    }
+    return count;
+}
+
+void CircleStorage::circlesAt(int x, int y, std::vector<size_t>& out) const {
+    out.clear();
+    const int radius2 = Circle::RADIUS * Circle::RADIUS;
+    for (int cy = cellCoord(y - Circle::RADIUS); cy <= cellCoord(y + Circle::RADIUS); ++cy) {
+        for (int cx = cellCoord(x - Circle::RADIUS); cx <= cellCoord(x + Circle::RADIUS); ++cx) {
+            auto cell = grid.find(cellKey(cx, cy));
+            if (cell == grid.end()) continue;
+            for (uint32_t index : cell->second) {
+                int dx = x - xs[index];
+                int dy = y - ys[index];
+                if (dx * dx + dy * dy <= radius2) {
+                    out.push_back(index);
+                }
+            }
+        }
+    }
+    std::sort(out.begin(), out.end());
 }
 
 void CircleStorage::clearSelection() {
-    for (auto& circle : circles) {
-        circle->setSelected(false);
+    std::fill(selection.begin(), selection.end(), 0);
+}
+
+size_t CircleStorage::removeSelected(std::vector<QPoint>* removed, size_t limit) {
+    // Пропускаем начало без выделенных кругов целыми словами
+    size_t word = 0;
+    while (word < selection.size() && selection[word] == 0) ++word;
+    if (word == selection.size()) return 0;
+
+    size_t count = xs.size();
+    size_t write = word * 64;
+    for (size_t read = write; read < count; ++read) {
+        if (isSelected(read)) {
+            indices[ids[read]] = REMOVED;
+            if (removed && limit) {
+                removed->push_back(QPoint(xs[read], ys[read]));
+                --limit;
+            }
+            continue;
+        }
+        xs[write] = xs[read];
+        ys[write] = ys[read];
+        ids[write] = ids[read];
+        indices[ids[write]] = uint32_t(write);
+        ++write;
     }
+
+    xs.resize(write);
+    ys.resize(write);
+    ids.resize(write);
+    selection.assign((write + 63) / 64, 0);
+    // Индексы сдвинулись, сетку проще построить заново
+    rebuildGrid();
+    return count - write;
 }
 
-void CircleStorage::removeSelected() {
-    auto it = std::remove_if(circles.begin(), circles.end(),
-        [](const std::shared_ptr<Circle>& circle) {
-            return circle->isSelected();
-        });
-    circles.erase(it, circles.end());
+// Реализация чтения и записи файлов
+static const size_t IO_CHUNK = 1 << 20;
+static const size_t LOADER_CHUNK = 256 * 1024;
+// Повреждённый заголовок не должен сразу занять всю память под reserve
+static const uint64_t MAX_RESERVE = uint64_t(1) << 26;
+static const size_t MAX_CSV_LINE = 4096;
+
+static void appendLittleEndian(std::string& out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        out.push_back(char((value >> (8 * i)) & 0xff));
+    }
+}
+
+static uint64_t readLittleEndian(const char* data, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+        value |= uint64_t(uint8_t(data[i])) << (8 * i);
+    }
+    return value;
+}
+
+// Zigzag переводит малые по модулю разности в малые беззнаковые числа
+static void appendVarint(std::string& out, int64_t value) {
+    uint64_t zigzag = (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+    while (zigzag >= 0x80) {
+        out.push_back(char(zigzag | 0x80));
+        zigzag >>= 7;
+    }
+    out.push_back(char(zigzag));
+}
+
+bool BinaryCircleDecoder::parseHeader() {
+    if (memcmp(header, CIRCLE_FILE_MAGIC, sizeof(CIRCLE_FILE_MAGIC)) != 0) {
+        return fail("Not a circles file");
+    }
+    uint32_t version = uint32_t(readLittleEndian(header + 4, 4));
+    if (version != CIRCLE_FILE_VERSION) {
+        return fail(QString("Unsupported file version %1").arg(version));
+    }
+    count = readLittleEndian(header + 8, 8);
+    storage.reserve(base + size_t(std::min(count, MAX_RESERVE)));
+    stage = count ? Stage::Coordinates : Stage::Done;
+    return true;
+}
+
+bool BinaryCircleDecoder::pushCircle() {
+    if (x < INT_MIN || x > INT_MAX || y < INT_MIN || y > INT_MAX) {
+        return fail("Coordinate out of range");
+    }
+    batchX[batchSize] = int(x);
+    batchY[batchSize] = int(y);
+    if (++batchSize == BATCH_SIZE) flushBatch();
+    if (++decoded == count) {
+        stage = Stage::Selection;
+        decoded = 0;
+    }
+    return true;
+}
+
+void BinaryCircleDecoder::flushBatch() {
+    storage.addCircles(batchX, batchY, batchSize);
+    batchSize = 0;
+}
+
+// Число целиком внутри буфера; false, если оно длиннее пяти байтов
+static inline bool decodeVarint(const uint8_t*& p, int64_t& value) {
+    uint64_t result = 0;
+    for (int shift = 0; shift <= 28; shift += 7) {
+        uint8_t byte = *p++;
+        result |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            value = int64_t(result >> 1) ^ -int64_t(result & 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool BinaryCircleDecoder::feed(const char* data, size_t size) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    const uint8_t* end = p + size;
+
+    if (stage == Stage::Header) {
+        size_t take = std::min(sizeof(header) - headerSize, size);
+        memcpy(header + headerSize, p, take);
+        headerSize += take;
+        p += take;
+        if (headerSize < sizeof(header)) return true;
+        if (!parseHeader()) return false;
+    }
+
+    while (p < end && stage == Stage::Coordinates) {
+        // Быстрый путь: пара чисел не пересекает границу куска
+        if (!haveX && shift == 0 && end - p >= 10) {
+            int64_t dx, dy;
+            if (!decodeVarint(p, dx) || !decodeVarint(p, dy)) return fail("Corrupted coordinate");
+            x += dx;
+            y += dy;
+            if (!pushCircle()) return false;
+            continue;
+        }
+        uint8_t byte = *p++;
+        varint |= uint64_t(byte & 0x7f) << shift;
+        if (byte & 0x80) {
+            shift += 7;
+            if (shift > 28) return fail("Corrupted coordinate");
+            continue;
+        }
+        int64_t delta = int64_t(varint >> 1) ^ -int64_t(varint & 1);
+        varint = 0;
+        shift = 0;
+        if (!haveX) {
+            nextX = x + delta;
+            haveX = true;
+            continue;
+        }
+        x = nextX;
+        y += delta;
+        haveX = false;
+        if (!pushCircle()) return false;
+    }
+    // Загруженные круги видны сразу после каждого куска
+    if (batchSize) flushBatch();
+
+    const uint64_t selectionBytes = (count + 7) / 8;
+    while (p < end && stage == Stage::Selection) {
+        uint8_t bits = *p++;
+        for (int bit = 0; bits && bit < 8; ++bit) {
+            if (!((bits >> bit) & 1)) continue;
+            uint64_t index = decoded * 8 + bit;
+            if (index >= count) return fail("Corrupted selection");
+            storage.setSelected(base + size_t(index), true);
+        }
+        if (++decoded == selectionBytes) stage = Stage::Done;
+    }
+
+    if (p < end) return fail("Unexpected data after the last circle");
+    return true;
+}
+
+bool BinaryCircleDecoder::finish() {
+    if (stage != Stage::Done) return fail("Unexpected end of file");
+    return true;
+}
+
+// Число с необязательной дробной частью, округлённое до целого
+static bool parseCoordinate(const char*& p, const char* end, int& value) {
+    while (p < end && (*p == ' ' || *p == '\t')) ++p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p++ == '-';
+    }
+    int64_t result = 0;
+    const char* digits = p;
+    while (p < end && *p >= '0' && *p <= '9') {
+        result = result * 10 + (*p++ - '0');
+        if (result > INT_MAX) return false;
+    }
+    bool any = p != digits;
+    if (p < end && *p == '.') {
+        const char* fraction = ++p;
+        if (p < end && *p >= '5' && *p <= '9') ++result;
+        while (p < end && *p >= '0' && *p <= '9') ++p;
+        any = any || p != fraction;
+    }
+    while (p < end && (*p == ' ' || *p == '\t')) ++p;
+    if (!any || result > INT_MAX) return false;
+    value = int(negative ? -result : result);
+    return true;
+}
+
+bool CsvCircleDecoder::parseLine(const char* begin, const char* end) {
+    ++lineNumber;
+    if (end > begin && end[-1] == '\r') --end;
+    const char* p = begin;
+    while (p < end && (*p == ' ' || *p == '\t')) ++p;
+    if (p == end || *p == '#') return true;
+    // Заголовок вида "x,y" допустим только первой строкой
+    if (lineNumber == 1 && ((*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z') || *p == '"')) return true;
+
+    int x = 0, y = 0;
+    bool ok = parseCoordinate(p, end, x) && p < end && *p++ == ',' && parseCoordinate(p, end, y);
+    bool selected = false;
+    if (ok && p < end) {
+        ok = *p++ == ',';
+        std::string_view field(p, size_t(end - p));
+        while (!field.empty() && (field.front() == ' ' || field.front() == '\t')) field.remove_prefix(1);
+        while (!field.empty() && (field.back() == ' ' || field.back() == '\t')) field.remove_suffix(1);
+        selected = field == "1" || field == "true";
+        ok = ok && (selected || field.empty() || field == "0" || field == "false");
+    }
+    if (!ok) {
+        return fail(QString("Line %1: expected x,y[,selected]").arg(lineNumber));
+    }
+    storage.addCircle(x, y);
+    if (selected) {
+        storage.setSelected(storage.size() - 1, true);
+    }
+    return true;
+}
+
+bool CsvCircleDecoder::feed(const char* data, size_t size) {
+    const char* end = data + size;
+    while (data < end) {
+        const char* newline = static_cast<const char*>(memchr(data, '\n', size_t(end - data)));
+        if (!newline) {
+            pending.append(data, end);
+            if (pending.size() > MAX_CSV_LINE) {
+                return fail(QString("Line %1 is too long").arg(lineNumber + 1));
+            }
+            return true;
+        }
+        bool ok;
+        if (pending.empty()) {
+            ok = parseLine(data, newline);
+        }
+        else {
+            pending.append(data, newline);
+            ok = parseLine(pending.data(), pending.data() + pending.size());
+            pending.clear();
+        }
+        if (!ok) return false;
+        data = newline + 1;
+    }
+    return true;
+}
+
+bool CsvCircleDecoder::finish() {
+    if (pending.empty()) return true;
+    bool ok = parseLine(pending.data(), pending.data() + pending.size());
+    pending.clear();
+    return ok;
+}
+
+bool readCircles(const QString& path, CircleDecoder& decoder, QString& error) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        error = file.errorString();
+        return false;
+    }
+    std::vector<char> buffer(IO_CHUNK);
+    for (;;) {
+        qint64 read = file.read(buffer.data(), qint64(buffer.size()));
+        if (read < 0) {
+            error = file.errorString();
+            return false;
+        }
+        if (read == 0) break;
+        if (!decoder.feed(buffer.data(), size_t(read))) {
+            error = decoder.getError();
+            return false;
+        }
+    }
+    if (!decoder.finish()) {
+        error = decoder.getError();
+        return false;
+    }
+    return true;
+}
+
+bool saveCircles(const CircleStorage& storage, const QString& path, QString& error) {
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        error = file.errorString();
+        return false;
+    }
+    std::string buffer;
+    buffer.reserve(IO_CHUNK + 64);
+    auto flush = [&]() {
+        bool ok = file.write(buffer.data(), qint64(buffer.size())) == qint64(buffer.size());
+        buffer.clear();
+        return ok;
+    };
+
+    const size_t count = storage.size();
+    buffer.append(CIRCLE_FILE_MAGIC, sizeof(CIRCLE_FILE_MAGIC));
+    appendLittleEndian(buffer, CIRCLE_FILE_VERSION, 4);
+    appendLittleEndian(buffer, count, 8);
+
+    bool ok = true;
+    int64_t x = 0, y = 0;
+    for (size_t i = 0; i < count && ok; ++i) {
+        appendVarint(buffer, storage.getX(i) - x);
+        appendVarint(buffer, storage.getY(i) - y);
+        x = storage.getX(i);
+        y = storage.getY(i);
+        if (buffer.size() >= IO_CHUNK) ok = flush();
+    }
+    for (size_t i = 0; i < count && ok; i += 8) {
+        uint8_t bits = 0;
+        for (size_t bit = 0; bit < 8 && i + bit < count; ++bit) {
+            if (storage.isSelected(i + bit)) bits |= uint8_t(1 << bit);
+        }
+        buffer.push_back(char(bits));
+        if (buffer.size() >= IO_CHUNK) ok = flush();
+    }
+
+    if (!ok || !flush() || !file.commit()) {
+        error = file.errorString();
+        return false;
+    }
+    return true;
+}
+
+// Реализация CircleLoader
+CircleLoader::CircleLoader(const QString& path, std::unique_ptr<CircleDecoder> decoder, QObject* parent)
+    : QObject(parent), file(path), decoder(std::move(decoder)), buffer(LOADER_CHUNK) {
+    timer.setInterval(0);
+    connect(&timer, &QTimer::timeout, this, &CircleLoader::step);
+}
+
+void CircleLoader::start() {
+    if (!file.open(QIODevice::ReadOnly)) {
+        finish(false, file.errorString());
+        return;
+    }
+    timer.start();
+}
+
+void CircleLoader::cancel() {
+    timer.stop();
+    file.close();
+}
+
+void CircleLoader::step() {
+    QElapsedTimer elapsed;
+    elapsed.start();
+    while (elapsed.elapsed() < STEP_BUDGET_MS) {
+        qint64 read = file.read(buffer.data(), qint64(buffer.size()));
+        if (read < 0) {
+            finish(false, file.errorString());
+            return;
+        }
+        if (read == 0) {
+            bool ok = decoder->finish();
+            finish(ok, ok ? QString() : decoder->getError());
+            return;
+        }
+        if (!decoder->feed(buffer.data(), size_t(read))) {
+            finish(false, decoder->getError());
+            return;
+        }
+    }
+    emit progress(file.pos(), file.size());
+}
+
+void CircleLoader::finish(bool ok, const QString& error) {
+    timer.stop();
+    file.close();
+    emit finished(ok, error);
 }
 
 // Реализация CircleWidget
-CircleWidget::CircleWidget(QWidget* parent) : QWidget(parent) {
+
+// Перо шириной 1 со сглаживанием выходит за контур круга на полпикселя
+static const int SPRITE_MARGIN = 1;
+static const int SPRITE_SIDE = Circle::RADIUS * 2 + SPRITE_MARGIN * 2;
+
+CircleWidget::CircleWidget(QWidget* parent) : QWidget(parent), renderMode(RenderMode::Sprites), loader(nullptr) {
     setMouseTracking(true);
     setFocusPolicy(Qt::StrongFocus);
     setStyleSheet("background-color: white;");
 }
 
 void CircleWidget::paintEvent(QPaintEvent* event) {
-    Q_UNUSED(event);
-
     QPainter painter(this);
     painter.setRenderHint(QPainter::Antialiasing);
 
-    for (const auto& circle : storage.getCircles()) {
-        circle->draw(painter);
+    if (renderMode == RenderMode::Sprites) {
+        drawSprites(painter, event->rect());
+        return;
+    }
+    for (size_t i = 0; i < storage.size(); ++i) {
+        storage.circleAt(i).draw(painter);
+    }
+}
+
+void CircleWidget::setRenderMode(RenderMode mode) {
+    if (renderMode == mode) return;
+    renderMode = mode;
+    update();
+}
+
+void CircleWidget::rebuildSprites() {
+    // Спрайты рисуются тем же Circle::draw, поэтому совпадают с режимом Ellipses
+    qreal ratio = devicePixelRatioF();
+    sprites = QPixmap(QSize(SPRITE_SIDE * 2, SPRITE_SIDE) * ratio);
+    sprites.setDevicePixelRatio(ratio);
+    sprites.fill(Qt::transparent);
+
+    QPainter painter(&sprites);
+    painter.setRenderHint(QPainter::Antialiasing);
+    for (int variant = 0; variant < 2; ++variant) {
+        Circle circle(SPRITE_SIDE * variant + SPRITE_SIDE / 2, SPRITE_SIDE / 2);
+        circle.setSelected(variant == 1);
+        circle.draw(painter);
+    }
+}
+
+void CircleWidget::drawSprites(QPainter& painter, const QRect& area) {
+    if (sprites.isNull() || sprites.devicePixelRatio() != devicePixelRatioF()) {
+        rebuildSprites();
+    }
+    // Источник задаётся в пикселях спрайта, масштаб возвращает его к размеру в точках
+    qreal ratio = sprites.devicePixelRatio();
+    qreal side = sprites.height();
+    qreal scale = 1.0 / ratio;
+    QRect visible = area.adjusted(-SPRITE_SIDE / 2, -SPRITE_SIDE / 2, SPRITE_SIDE / 2, SPRITE_SIDE / 2);
+
+    fragments.clear();
+    for (size_t i = 0; i < storage.size(); ++i) {
+        int x = storage.getX(i);
+        int y = storage.getY(i);
+        if (!visible.contains(x, y)) continue;
+        // Центр фрагмента совпадает с центром круга
+        fragments.push_back(QPainter::PixmapFragment::create(QPointF(x, y),
+            QRectF(storage.isSelected(i) ? side : 0.0, 0.0, side, side), scale, scale));
+    }
+    if (!fragments.empty()) {
+        painter.drawPixmapFragments(fragments.data(), int(fragments.size()), sprites);
     }
 }
 
 void CircleWidget::mousePressEvent(QMouseEvent* event) {
+    if (loader) return;
     if (event->button() == Qt::LeftButton) {
         int x = event->pos().x();
         int y = event->pos().y();
 
         bool clickedOnCircle = false;
-        std::vector<std::shared_ptr<Circle>> circlesUnderCursor;
-
-        for (const auto& circle : storage.getCircles()) {
-            if (circle->contains(x, y)) {
-                circlesUnderCursor.push_back(circle);
-            }
-        }
+        storage.circlesAt(x, y, circlesUnderCursor);
 
         if (!circlesUnderCursor.empty()) { // ВЫДЕЛЕНИЕ
             if (event->modifiers() & Qt::ControlModifier) {
-                for (auto& circle : circlesUnderCursor) {
-                    circle->setSelected(!circle->isSelected());
+                for (size_t index : circlesUnderCursor) {
+                    storage.setSelected(index, !storage.isSelected(index));
                 }
             }
             else {
                 storage.clearSelection();
-                for (auto& circle : circlesUnderCursor) {
-                    circle->setSelected(true);
+                for (size_t index : circlesUnderCursor) {
+                    storage.setSelected(index, true);
                 }
             }
             clickedOnCircle = true;
 
             QString info = QString("Highlighted circles: %1").arg(circlesUnderCursor.size()); 
             if (circlesUnderCursor.size() == 1) {
-                auto circle = circlesUnderCursor.front();
-                info += QString(" (x: %1, y: %2)").arg(circle->getX()).arg(circle->getY());
+                size_t index = circlesUnderCursor.front();
+                info += QString(" (x: %1, y: %2)").arg(storage.getX(index)).arg(storage.getY(index));
             }
             showMessage(info);
         }
 
         if (!clickedOnCircle) {
             storage.clearSelection();
-            auto newCircle = std::make_shared<Circle>(x, y);
-            storage.addCircle(newCircle);
+            storage.addCircle(x, y);
 
             QString message = QString("A circle has been created! Center coordinates: x: %1, y: %2")
                 .arg(x).arg(y);
@@ -111,23 +654,136 @@ void CircleWidget::mousePressEvent(QMouseEvent* event) {
 }
 
 void CircleWidget::keyPressEvent(QKeyEvent* event) {
+    if (loader) return;
     if (event->key() == Qt::Key_Delete) {
-        QString deletedInfo = "Circles with coordinates have been removed:\n";
-        bool anyDeleted = false;
+        deleteSelected();
+    }
+}
 
-        for (const auto& circle : storage.getCircles()) {
-            if (circle->isSelected()) {
-                deletedInfo += QString("x: %1, y: %2\n").arg(circle->getX()).arg(circle->getY());
-                anyDeleted = true;
+// Сообщение ограниченного размера: первые DELETE_SUMMARY_LIMIT кругов и число остальных
+static QString deleteSummary(size_t removed, const std::vector<QPoint>& circles) {
+    size_t listed = std::min(circles.size(), CircleWidget::DELETE_SUMMARY_LIMIT);
+    QString message;
+    // "x: -2147483648, y: -2147483648\n" - не больше 32 символов на круг
+    message.reserve(int(80 + listed * 32));
+    message += QLatin1String("Circles with coordinates have been removed (");
+    message += QString::number(qulonglong(removed));
+    message += QLatin1String("):\n");
+    for (size_t i = 0; i < listed; ++i) {
+        message += QLatin1String("x: ");
+        message += QString::number(circles[i].x());
+        message += QLatin1String(", y: ");
+        message += QString::number(circles[i].y());
+        message += QLatin1Char('\n');
+    }
+    if (removed > listed) {
+        message += QLatin1String("and ");
+        message += QString::number(qulonglong(removed - listed));
+        message += QLatin1String(" more\n");
+    }
+    return message;
+}
+
+void CircleWidget::deleteSelected() {
+    bool logAll = !deleteLogPath.isEmpty();
+    removedCircles.clear();
+    removedCircles.reserve(logAll ? storage.selectedCount() : DELETE_SUMMARY_LIMIT);
+    size_t removed = storage.removeSelected(&removedCircles, logAll ? SIZE_MAX : DELETE_SUMMARY_LIMIT);
+    if (removed == 0) return;
+
+    showMessage(deleteSummary(removed, removedCircles));
+    if (logAll) {
+        writeDeleteLog(std::move(removedCircles));
+        removedCircles = std::vector<QPoint>();
+    }
+    update();
+}
+
+void CircleWidget::writeDeleteLog(std::vector<QPoint> circles) {
+    // Новая запись ждёт предыдущую в фоне, порядок в файле сохраняется
+    std::future<void> previous = std::move(deleteLog);
+    deleteLog = std::async(std::launch::async,
+        [this, path = deleteLogPath, circles = std::move(circles), previous = std::move(previous)]() mutable {
+            if (previous.valid()) previous.wait();
+
+            QFile file(path);
+            bool ok = file.open(QIODevice::WriteOnly | QIODevice::Append);
+            std::string buffer;
+            buffer.reserve(IO_CHUNK + 32);
+            char number[16];
+            for (size_t i = 0; ok && i < circles.size(); ++i) {
+                buffer.append(number, std::to_chars(number, number + sizeof(number), circles[i].x()).ptr);
+                buffer.push_back(',');
+                buffer.append(number, std::to_chars(number, number + sizeof(number), circles[i].y()).ptr);
+                buffer.push_back('\n');
+                if (buffer.size() >= IO_CHUNK) {
+                    ok = file.write(buffer.data(), qint64(buffer.size())) == qint64(buffer.size());
+                    buffer.clear();
+                }
             }
-        }
+            if (ok && !buffer.empty()) {
+                ok = file.write(buffer.data(), qint64(buffer.size())) == qint64(buffer.size());
+            }
+            if (ok) ok = file.flush();
+            if (!ok) {
+                // Сообщение показывается из потока GUI
+                QMetaObject::invokeMethod(this, [this, path]() {
+                    showMessage(QString("Cannot write the delete log %1").arg(path));
+                }, Qt::QueuedConnection);
+            }
+        });
+}
 
-        if (anyDeleted) {
-            storage.removeSelected();
-            showMessage(deletedInfo);
+void CircleWidget::flushDeleteLog() {
+    if (deleteLog.valid()) deleteLog.wait();
+}
+
+void CircleWidget::loadFile(const QString& path, bool csv) {
+    if (loader) {
+        loader->cancel();
+        loader->deleteLater();
+        loader = nullptr;
+    }
+    // Файл разбирается в отдельное хранилище, текущие круги остаются на
+    // экране и заменяются только после успешной загрузки
+    loading = std::make_unique<CircleStorage>();
+
+    std::unique_ptr<CircleDecoder> decoder;
+    if (csv) decoder = std::make_unique<CsvCircleDecoder>(*loading);
+    else decoder = std::make_unique<BinaryCircleDecoder>(*loading);
+
+    loader = new CircleLoader(path, std::move(decoder), this);
+    connect(loader, &CircleLoader::progress, this, [this](qint64 done, qint64 total) {
+        showMessage(QString("Loading... %1%").arg(total > 0 ? done * 100 / total : 0));
+    });
+    connect(loader, &CircleLoader::finished, this, [this, path](bool ok, const QString& error) {
+        loader->deleteLater();
+        loader = nullptr;
+        if (ok) {
+            storage = std::move(*loading);
+            showMessage(QString("Loaded %1 circles from %2").arg(storage.size()).arg(path));
             update();
         }
+        else {
+            showMessage(QString("Cannot load %1: %2").arg(path, error));
+        }
+        loading.reset();
+    });
+    loader->start();
+}
+
+bool CircleWidget::saveFile(const QString& path) {
+    if (loader) {
+        showMessage("Wait until the file is loaded");
+        return false;
     }
+    QString error;
+    if (!saveCircles(storage, path, error)) {
+        showMessage(QString("Cannot save %1: %2").arg(path, error));
+        return false;
+    }
+    showMessage(QString("Saved %1 circles to %2").arg(storage.size()).arg(path));
+    return true;
 }
 
 void CircleWidget::resizeEvent(QResizeEvent* event) {
@@ -156,8 +812,27 @@ MainWindow::MainWindow(QWidget* parent) : QMainWindow(parent) {
     setWindowTitle("CircleApp");
     resize(800, 600);
 
-    CircleWidget* widget = new CircleWidget(this);
-    setCentralWidget(widget);
+    circleWidget = new CircleWidget(this);
+    setCentralWidget(circleWidget);
+
+    QAction* openAction = new QAction("&Open...", this);
+    QAction* importAction = new QAction("&Import CSV...", this);
+    QAction* saveAction = new QAction("&Save...", this);
+    QAction* deleteLogAction = new QAction("&Log deletions to...", this);
+    openAction->setShortcut(QKeySequence::Open);
+    saveAction->setShortcut(QKeySequence::Save);
+
+    QMenu* fileMenu = menuBar()->addMenu("&File");
+    fileMenu->addAction(openAction);
+    fileMenu->addAction(importAction);
+    fileMenu->addAction(saveAction);
+    fileMenu->addSeparator();
+    fileMenu->addAction(deleteLogAction);
+
+    connect(openAction, &QAction::triggered, this, [this]() { openFile(false); });
+    connect(importAction, &QAction::triggered, this, [this]() { openFile(true); });
+    connect(saveAction, &QAction::triggered, this, [this]() { saveFile(); });
+    connect(deleteLogAction, &QAction::triggered, this, [this]() { chooseDeleteLog(); });
 
     statusBar()->showMessage("Done. Click to create a circle, Ctrl+click to select multiple objects, Del to delete");
 
@@ -165,7 +840,33 @@ MainWindow::MainWindow(QWidget* parent) : QMainWindow(parent) {
     statusBar()->addPermanentWidget(infoLabel);
 }
 
-// Точка входа
+void MainWindow::openFile(bool csv) {
+    QString path = QFileDialog::getOpenFileName(this, csv ? "Import CSV" : "Open",
+        QString(), csv ? "CSV files (*.csv);;All files (*)" : "Circles (*.circles);;All files (*)");
+    if (!path.isEmpty()) {
+        circleWidget->loadFile(path, csv);
+    }
+}
+
+void MainWindow::saveFile() {
+    QString path = QFileDialog::getSaveFileName(this, "Save", QString(), "Circles (*.circles)");
+    if (!path.isEmpty()) {
+        circleWidget->saveFile(path);
+    }
+}
+
+void MainWindow::chooseDeleteLog() {
+    // Журнал дописывается, поэтому о перезаписи не спрашиваем
+    QString path = QFileDialog::getSaveFileName(this, "Log deletions to", QString(),
+        "CSV files (*.csv);;All files (*)", nullptr, QFileDialog::DontConfirmOverwrite);
+    if (!path.isEmpty()) {
+        circleWidget->setDeleteLogPath(path);
+        statusBar()->showMessage(QString("Deleted circles are logged to %1").arg(path), 3000);
+    }
+}
+
+// Точка входа; CircleBenchmark.cpp собирается со своей
+#ifndef CIRCLE_BENCHMARK
 int main(int argc, char* argv[]) {
 
     QApplication app(argc, argv);
@@ -175,3 +876,4 @@ int main(int argc, char* argv[]) {
 
     return app.exec();
 }
+#endif
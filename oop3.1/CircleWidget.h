@@ -2,14 +2,23 @@
 
 #include <QWidget>
 #include <QPainter>
+#include <QPixmap>
 #include <QMouseEvent>
 #include <QKeyEvent>
 #include <QMainWindow>
 #include <QLabel>
 #include <QStatusBar>
 #include <QApplication>
+#include <QFile>
+#include <QTimer>
+#include <QPoint>
 #include <vector>
 #include <memory>
+#include <string>
+#include <algorithm>
+#include <unordered_map>
+#include <cstdint>
+#include <future>
 
 // Класс круга
 class Circle {
@@ -30,17 +39,175 @@ private:
     bool selected;
 };
 
-// Кастомный контейнер для хранения кругов
+// Стабильный идентификатор круга: не меняется при удалении других кругов
+// и не переиспользуется
+using CircleId = uint32_t;
+
+// Кастомный контейнер для хранения кругов. Круги хранятся по значению:
+// координаты в плотных массивах, выделение в битовом наборе. Индекс круга
+// меняется при удалении, для внешних ссылок есть CircleId.
 class CircleStorage {
 public:
-    void addCircle(std::shared_ptr<Circle> circle);
+    // Ячейка сетки: центр круга, содержащего точку, лежит не дальше RADIUS
+    // по каждой оси, поэтому клик проверяет не больше четырёх ячеек
+    static const int CELL_SIZE = Circle::RADIUS * 2;
+    static const size_t NPOS = size_t(-1);
+
+    CircleId addCircle(int x, int y);
+    CircleId addCircle(const Circle& circle);
+    // Прежний API: круг копируется в хранилище, указатель не сохраняется
+    CircleId addCircle(const std::shared_ptr<Circle>& circle) { return addCircle(*circle); }
+    // Пакетное добавление для загрузки файлов. Сетка дополняется сразу,
+    // поэтому загрузчик строит её по частям в своих шагах
+    void addCircles(const int* x, const int* y, size_t count);
     void clearSelection();
-    void removeSelected();
-    std::vector<std::shared_ptr<Circle>>& getCircles() { return circles; }
-    const std::vector<std::shared_ptr<Circle>>& getCircles() const { return circles; }
+    // Устойчивое сжатие за один проход, порядок оставшихся кругов сохраняется.
+    // Если removed задан, в него дописываются координаты первых limit
+    // удалённых кругов
+    size_t removeSelected(std::vector<QPoint>* removed = nullptr, size_t limit = SIZE_MAX);
+    void clear();
+    void reserve(size_t count);
+
+    size_t size() const { return xs.size(); }
+    int getX(size_t index) const { return xs[index]; }
+    int getY(size_t index) const { return ys[index]; }
+    bool isSelected(size_t index) const { return (selection[index >> 6] >> (index & 63)) & 1; }
+    void setSelected(size_t index, bool selected) {
+        uint64_t bit = uint64_t(1) << (index & 63);
+        if (selected) selection[index >> 6] |= bit;
+        else selection[index >> 6] &= ~bit;
+    }
+    size_t selectedCount() const;
+    // Круг по индексу как значение, для отрисовки и проверки попадания
+    Circle circleAt(size_t index) const;
+    // Прежний API: снимок всех кругов в порядке хранения. Собирается заново
+    // при каждом вызове, изменения в нём в хранилище не попадают
+    std::vector<std::shared_ptr<Circle>> getCircles() const;
+
+    CircleId idAt(size_t index) const { return ids[index]; }
+    // NPOS, если круг удалён
+    size_t indexOf(CircleId id) const {
+        return id < indices.size() && indices[id] != REMOVED ? indices[id] : NPOS;
+    }
+
+    // Индексы кругов, содержащих точку, в порядке хранения; out очищается
+    // и переиспользуется между вызовами
+    void circlesAt(int x, int y, std::vector<size_t>& out) const;
+
+private:
+    static const uint32_t REMOVED = UINT32_MAX;
+
+    static int cellCoord(int value);
+    static uint64_t cellKey(int cellX, int cellY);
+    void insertIntoGrid(size_t index);
+    void rebuildGrid();
+
+    std::vector<int> xs, ys;
+    std::vector<uint64_t> selection; // бит i - круг с индексом i
+    std::vector<CircleId> ids;       // индекс -> id
+    std::vector<uint32_t> indices;   // id -> индекс, REMOVED для удалённых
+    std::unordered_map<uint64_t, std::vector<uint32_t>> grid; // ячейка -> индексы кругов
+};
+
+// Формат .circles: "CIRC", версия (uint32), число кругов (uint64), всё
+// little-endian. Дальше для каждого круга разности x и y с предыдущим кругом
+// в zigzag varint, в конце биты выделения, по одному на круг.
+const char CIRCLE_FILE_MAGIC[4] = { 'C', 'I', 'R', 'C' };
+const uint32_t CIRCLE_FILE_VERSION = 1;
+
+// Потоковый декодер: принимает байты кусками любого размера и добавляет
+// круги в конец хранилища по мере разбора
+class CircleDecoder {
+public:
+    explicit CircleDecoder(CircleStorage& storage) : storage(storage), base(storage.size()) {}
+    virtual ~CircleDecoder() = default;
+
+    // false при ошибке формата, текст в getError()
+    virtual bool feed(const char* data, size_t size) = 0;
+    // Конец входа: проверяет, что файл не оборван
+    virtual bool finish() = 0;
+    const QString& getError() const { return error; }
+
+protected:
+    bool fail(const QString& message) { error = message; return false; }
+
+    CircleStorage& storage;
+    size_t base; // индекс первого загружаемого круга
+    QString error;
+};
+
+class BinaryCircleDecoder : public CircleDecoder {
+public:
+    using CircleDecoder::CircleDecoder;
+    bool feed(const char* data, size_t size) override;
+    bool finish() override;
+
+private:
+    enum class Stage { Header, Coordinates, Selection, Done };
+
+    bool parseHeader();
+    bool pushCircle(); // x, y декодированы
+    void flushBatch();
+
+    static const size_t BATCH_SIZE = 4096;
+
+    Stage stage = Stage::Header;
+    char header[16];
+    size_t headerSize = 0;
+    uint64_t count = 0;
+    uint64_t decoded = 0;      // кругов на этапе координат, байтов на этапе выделения
+    uint64_t varint = 0;       // недочитанное число на границе кусков
+    int shift = 0;
+    bool haveX = false;
+    int64_t x = 0, y = 0, nextX = 0;
+    int batchX[BATCH_SIZE], batchY[BATCH_SIZE]; // круги до передачи в addCircles
+    size_t batchSize = 0;
+};
+
+// CSV из внешних источников точек: строки "x,y" или "x,y,selected".
+// Пустые строки, строки с # и строка заголовка пропускаются, дробные
+// координаты округляются.
+class CsvCircleDecoder : public CircleDecoder {
+public:
+    using CircleDecoder::CircleDecoder;
+    bool feed(const char* data, size_t size) override;
+    bool finish() override;
+
+private:
+    bool parseLine(const char* begin, const char* end);
+
+    std::string pending; // начало строки из предыдущего куска
+    size_t lineNumber = 0;
+};
+
+// Синхронное чтение файла целиком через декодер
+bool readCircles(const QString& path, CircleDecoder& decoder, QString& error);
+bool saveCircles(const CircleStorage& storage, const QString& path, QString& error);
+
+// Читает файл в цикле событий шагами не дольше STEP_BUDGET_MS, чтобы
+// GUI оставался отзывчивым на больших файлах
+class CircleLoader : public QObject {
+    Q_OBJECT
+
+public:
+    static const int STEP_BUDGET_MS = 8;
+
+    CircleLoader(const QString& path, std::unique_ptr<CircleDecoder> decoder, QObject* parent = nullptr);
+    void start();
+    void cancel();
+
+signals:
+    void progress(qint64 bytesRead, qint64 bytesTotal);
+    void finished(bool ok, const QString& error);
 
 private:
-    std::vector<std::shared_ptr<Circle>> circles;
+    void step();
+    void finish(bool ok, const QString& error);
+
+    QFile file;
+    std::unique_ptr<CircleDecoder> decoder;
+    std::vector<char> buffer;
+    QTimer timer;
 };
 
 // Виджет-холст для отрисовки кругов
@@ -48,8 +215,30 @@ class CircleWidget : public QWidget {
     Q_OBJECT
 
 public:
+    // Ellipses - каждый круг рисуется отдельно, Sprites - круги копируются
+    // из заранее отрисованных спрайтов одним вызовом drawPixmapFragments
+    enum class RenderMode { Ellipses, Sprites };
+
     CircleWidget(QWidget* parent = nullptr);
 
+    void setRenderMode(RenderMode mode);
+    RenderMode getRenderMode() const { return renderMode; }
+    CircleStorage& getStorage() { return storage; }
+
+    // Заменяет круги содержимым файла, если он прочитан целиком; загрузка
+    // идёт кусками, ввод на это время игнорируется
+    void loadFile(const QString& path, bool csv);
+    bool saveFile(const QString& path);
+    bool isLoading() const { return loader != nullptr; }
+
+    // Сколько удалённых кругов перечисляется в строке состояния
+    static const size_t DELETE_SUMMARY_LIMIT = 10;
+    // Полный список удалённых кругов дописывается в этот файл строками
+    // "x,y" в фоновом потоке; пустой путь - не писать
+    void setDeleteLogPath(const QString& path) { deleteLogPath = path; }
+    // Дожидается записи журнала удалений
+    void flushDeleteLog();
+
 protected:
     void paintEvent(QPaintEvent* event) override;
     void mousePressEvent(QMouseEvent* event) override;
@@ -58,6 +247,24 @@ protected:
 
 private:
     CircleStorage storage;
+    std::vector<size_t> circlesUnderCursor; // переиспользуется между кликами
+
+    RenderMode renderMode;
+    QPixmap sprites; // обычный и выделенный круг рядом, в пикселях экрана
+    std::vector<QPainter::PixmapFragment> fragments; // переиспользуется между кадрами
+
+    CircleLoader* loader; // текущая загрузка, дочерний объект виджета
+    std::unique_ptr<CircleStorage> loading; // куда разбирается загружаемый файл
+
+    QString deleteLogPath;
+    std::vector<QPoint> removedCircles; // переиспользуется между удалениями
+    std::future<void> deleteLog;        // последняя запись журнала
+
+    void deleteSelected();
+    void writeDeleteLog(std::vector<QPoint> circles);
+
+    void rebuildSprites();
+    void drawSprites(QPainter& painter, const QRect& area);
 
     // Для вывода сообщений в GUI вместо консоли
     void showMessage(const QString& message);
@@ -69,4 +276,11 @@ class MainWindow : public QMainWindow {
 
 public:
     MainWindow(QWidget* parent = nullptr);
+
+private:
+    CircleWidget* circleWidget;
+
+    void openFile(bool csv);
+    void saveFile();
+    void chooseDeleteLog();
 };
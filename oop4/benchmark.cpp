@@ -0,0 +1,944 @@
+#include "shapeditor.h"
+#include <QApplication>
+#include <QCoreApplication>
+#include <QStringList>
+#include <QSysInfo>
+#include <QDateTime>
+#include <QTemporaryDir>
+#include <QEventLoop>
+#include <random>
+#include <cmath>
+#include <cstdlib>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <iomanip>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+// Headless benchmarks for the shape editor. Runs on the offscreen platform
+// plugin and writes results in Google Benchmark's JSON layout, so its
+// compare.py can diff two runs:
+//
+//   benchmark [--counts=1000,100000] [--kinds=circle,line,mixed]
+//             [--document-counts=1000000,10000000] [--world-counts=1000000,10000000]
+//             [--iterations=5] [--out=results.json]
+//
+// Exits with 1 if a hit-test kernel disagrees with Shape::contains.
+
+// Every heap allocation of the process is counted, so each result can report
+// allocations per iteration of its timed body
+static std::atomic<size_t> allocation_count(0);
+
+void* operator new(size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* memory = std::malloc(size ? size : 1)) return memory;
+    throw std::bad_alloc();
+}
+
+// The deletes stay out of line: inlined next to the operator new above, GCC
+// takes their free() for a mismatched deallocation (-Wmismatched-new-delete)
+[[gnu::noinline]] void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+[[gnu::noinline]] void operator delete(void* memory, size_t) noexcept {
+    std::free(memory);
+}
+
+namespace {
+
+// Stream buffer that drops everything written to it
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int c) override { return c; }
+};
+
+const int CANVAS_WIDTH = 1920;
+const int CANVAS_HEIGHT = 1080;
+
+struct Options {
+    std::vector<size_t> counts = { 1000, 10000, 100000, 1000000 };
+    std::vector<QString> kinds = { "circle", "rectangle", "square", "ellipse", "triangle", "line", "mixed" };
+    std::vector<size_t> document_counts = { 1000000, 10000000 };
+    std::vector<size_t> world_counts = { 1000000, 10000000 };
+    int iterations = 5;
+    QString out;
+};
+
+struct Result {
+    std::string name;
+    int iterations;
+    double mean_ms;
+    double min_ms;
+    double max_ms;
+    std::vector<std::pair<std::string, double>> counters; // extra fields of the JSON entry
+};
+
+Options parse_options(const QStringList& arguments) {
+    Options options;
+    for (const QString& argument : arguments.mid(1)) {
+        QString value = argument.section('=', 1);
+        if (argument.startsWith("--counts=")) {
+            options.counts.clear();
+            for (const QString& count : value.split(',', Qt::SkipEmptyParts)) {
+                options.counts.push_back(size_t(count.toULongLong()));
+            }
+        }
+        else if (argument.startsWith("--kinds=")) {
+            options.kinds.clear();
+            for (const QString& kind : value.split(',', Qt::SkipEmptyParts)) {
+                options.kinds.push_back(kind);
+            }
+        }
+        else if (argument.startsWith("--document-counts=")) {
+            options.document_counts.clear();
+            for (const QString& count : value.split(',', Qt::SkipEmptyParts)) {
+                options.document_counts.push_back(size_t(count.toULongLong()));
+            }
+        }
+        else if (argument.startsWith("--world-counts=")) {
+            options.world_counts.clear();
+            for (const QString& count : value.split(',', Qt::SkipEmptyParts)) {
+                options.world_counts.push_back(size_t(count.toULongLong()));
+            }
+        }
+        else if (argument.startsWith("--iterations=")) {
+            options.iterations = std::max(1, value.toInt());
+        }
+        else if (argument.startsWith("--out=")) {
+            options.out = value;
+        }
+        else {
+            std::cerr << "Unknown option " << argument.toStdString() << "\n";
+        }
+    }
+    return options;
+}
+
+// Heap bytes in use, including mmapped blocks; 0 where they cannot be read.
+// Unlike the resident set size, it also counts allocations that reuse pages
+// freed by an earlier scene.
+size_t heap_bytes() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+// Deterministic scene of count shapes, "mixed" cycles through every kind.
+// Shapes keep a margin from the canvas edges so moves and resizes never block.
+void populate(ShapesContainer& container, const QString& kind, size_t count, quint32 seed) {
+    std::mt19937 random(seed);
+    std::uniform_int_distribution<int> xs(10, CANVAS_WIDTH - 110);
+    std::uniform_int_distribution<int> ys(10, CANVAS_HEIGHT - 110);
+    ShapeKind fixed = Shape::kind_from_id(kind);
+
+    container.reserve(container.size() + count);
+    for (size_t i = 0; i < count; ++i) {
+        ShapeKind shape_kind = fixed != ShapeKind::Unknown ? fixed : ShapeKind(i % size_t(ShapeKind::Unknown));
+        container.create(shape_kind, xs(random), ys(random));
+    }
+}
+
+template<class Setup, class Body>
+Result measure(const std::string& name, int iterations, Setup setup, Body body) {
+    Result result = { name, iterations, 0.0, 1e300, 0.0, {} };
+    size_t allocations = 0;
+    for (int i = 0; i < iterations; ++i) {
+        setup(i);
+        size_t allocations_before = allocation_count.load(std::memory_order_relaxed);
+        auto start = std::chrono::steady_clock::now();
+        body(i);
+        double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        allocations += allocation_count.load(std::memory_order_relaxed) - allocations_before;
+        result.mean_ms += elapsed;
+        result.min_ms = std::min(result.min_ms, elapsed);
+        result.max_ms = std::max(result.max_ms, elapsed);
+        // Pending repaints are not part of the next measurement
+        QCoreApplication::processEvents();
+    }
+    result.mean_ms /= iterations;
+    result.counters.push_back({ "allocations", double(allocations) / iterations });
+    return result;
+}
+
+void send_key(QWidget* widget, int key, Qt::KeyboardModifiers modifiers) {
+    QKeyEvent event(QEvent::KeyPress, key, modifiers);
+    QCoreApplication::sendEvent(widget, &event);
+}
+
+void send_click(QWidget* widget, const QPoint& point, Qt::KeyboardModifiers modifiers = Qt::NoModifier) {
+    QMouseEvent press(QEvent::MouseButtonPress, point, Qt::LeftButton, Qt::LeftButton, modifiers);
+    QCoreApplication::sendEvent(widget, &press);
+    QMouseEvent release(QEvent::MouseButtonRelease, point, Qt::LeftButton, Qt::NoButton, modifiers);
+    QCoreApplication::sendEvent(widget, &release);
+}
+
+void send_mouse(QWidget* widget, QEvent::Type type, const QPoint& point, Qt::MouseButtons buttons) {
+    QMouseEvent event(type, point, Qt::LeftButton, buttons, Qt::NoModifier);
+    QCoreApplication::sendEvent(widget, &event);
+}
+
+// Rubber-band or lasso drag from the empty top-left corner: every iteration is
+// one mouse move, timed through the selection update up to the repainted frame.
+// The interactive budget is one 60 Hz frame.
+const double FRAME_BUDGET_MS = 16.0;
+const int DRAG_MOVES = 60;
+
+Result drag_region(CanvasWidget& canvas, const QString& tool, const std::string& name) {
+    canvas.set_current_shape_type(tool);
+    canvas.get_shapes_container().set_all_selected(false);
+    canvas.invalidate();
+    canvas.repaint();
+    send_mouse(&canvas, QEvent::MouseButtonPress, QPoint(2, 2), Qt::LeftButton);
+    canvas.repaint();
+
+    const double PI = 3.14159265358979;
+    std::vector<QPoint> path(DRAG_MOVES);
+    for (int i = 0; i < DRAG_MOVES; ++i) {
+        double t = double(i + 1) / DRAG_MOVES;
+        if (tool == "lasso") {
+            // A loop through the whole canvas that comes back towards the start
+            path[size_t(i)] = QPoint(2 + int((CANVAS_WIDTH - 10) * std::sin(PI * t)),
+                2 + int((CANVAS_HEIGHT - 10) * std::sin(PI * t) * t));
+        }
+        else {
+            path[size_t(i)] = QPoint(2 + int((CANVAS_WIDTH - 10) * t), 2 + int((CANVAS_HEIGHT - 10) * t));
+        }
+    }
+
+    int over_budget = 0;
+    Result result = measure(name, DRAG_MOVES,
+        [&](int) {},
+        [&](int i) {
+            QElapsedTimer clock;
+            clock.start();
+            send_mouse(&canvas, QEvent::MouseMove, path[size_t(i)], Qt::LeftButton);
+            canvas.repaint();
+            if (double(clock.nsecsElapsed()) / 1e6 > FRAME_BUDGET_MS) ++over_budget;
+        });
+    send_mouse(&canvas, QEvent::MouseButtonRelease, path.back(), Qt::NoButton);
+    canvas.set_current_shape_type(QString());
+    QCoreApplication::processEvents();
+
+    result.counters.push_back({ "budget_ms", FRAME_BUDGET_MS });
+    result.counters.push_back({ "moves_over_budget", double(over_budget) });
+    return result;
+}
+
+// Scripted input replay: events arrive on a timer as they would from the
+// window system, and the canvas coalesces whatever piles up between frames.
+// Reports how long the canvas lags behind the last event and how many frames
+// and bulk edits it needed.
+const int REPLAY_EVENTS = 60;
+const int REPLAY_INTERVAL_MS = 33; // typical keyboard auto-repeat
+
+template<class Send>
+Result replay(CanvasWidget& canvas, const std::string& name, Send send) {
+    Profiler& profiler = Profiler::instance();
+    profiler.reset();
+    profiler.set_enabled(true);
+
+    int sent = 0;
+    QTimer sender;
+    sender.setTimerType(Qt::PreciseTimer);
+    QObject::connect(&sender, &QTimer::timeout, [&]() {
+        send(sent);
+        if (++sent == REPLAY_EVENTS) sender.stop();
+    });
+
+    QElapsedTimer clock;
+    clock.start();
+    sender.start(REPLAY_INTERVAL_MS);
+    while (sent < REPLAY_EVENTS || canvas.has_pending_input()) {
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+    }
+    QCoreApplication::processEvents();
+    double total_ms = double(clock.nsecsElapsed()) / 1e6;
+
+    Result result = { name, 1, total_ms, total_ms, total_ms, {} };
+    result.counters.push_back({ "lag_ms", std::max(0.0, total_ms - double(REPLAY_EVENTS * REPLAY_INTERVAL_MS)) });
+    result.counters.push_back({ "events", double(REPLAY_EVENTS) });
+    result.counters.push_back({ "frames", double(profiler.frames()) });
+    result.counters.push_back({ "bulk_edits", double(profiler.stats(ProfileZone::Transform).calls +
+        profiler.stats(ProfileZone::Resize).calls) });
+    result.counters.push_back({ "paint_p95_ms", profiler.stats(ProfileZone::Paint).percentile_ms(0.95) });
+    profiler.set_enabled(false);
+    profiler.reset();
+    return result;
+}
+
+// Holds an arrow key back and forth, the whole scene selected
+Result replay_key_hold(CanvasWidget& canvas, Qt::KeyboardModifiers modifiers, const std::string& name) {
+    canvas.select_all();
+    return replay(canvas, name, [&](int i) {
+        int key = (i / 10) % 2 ? Qt::Key_Left : Qt::Key_Right;
+        QCoreApplication::postEvent(&canvas, new QKeyEvent(QEvent::KeyPress, key, modifiers, QString(), true));
+    });
+}
+
+// Drags the window edge in and out by a few pixels per event
+Result replay_edge_drag(CanvasWidget& canvas, const std::string& name) {
+    Result result = replay(canvas, name, [&](int i) {
+        int offset = 8 * ((i % 20) < 10 ? i % 10 : 10 - i % 10);
+        canvas.resize(CANVAS_WIDTH - offset, CANVAS_HEIGHT - offset);
+    });
+    canvas.resize(CANVAS_WIDTH, CANVAS_HEIGHT);
+    canvas.apply_pending_input();
+    return result;
+}
+
+void run_scene(const Options& options, const QString& kind, size_t count, std::vector<Result>& results) {
+    std::string suffix = "/" + kind.toStdString() + "/" + std::to_string(count);
+    const int iterations = options.iterations;
+
+    CanvasWidget canvas;
+    canvas.resize(CANVAS_WIDTH, CANVAS_HEIGHT);
+    canvas.show();
+    QCoreApplication::processEvents();
+
+    ShapesContainer& container = canvas.get_shapes_container();
+    size_t before = heap_bytes();
+    populate(container, kind, count, 1);
+    size_t after = heap_bytes();
+
+    Result memory = { "memory_per_shape" + suffix, 1, 0.0, 0.0, 0.0, {} };
+    if (before && after > before) memory.counters.push_back({ "bytes_per_shape", double(after - before) / double(count) });
+    results.push_back(memory);
+
+    // Every shape is on screen, so with a single kind this is the batcher's
+    // throughput for that kind
+    Result paint_full = measure("paint_full" + suffix, iterations,
+        [&](int) { canvas.invalidate(); },
+        [&](int) { canvas.repaint(); });
+    paint_full.counters.push_back({ "shapes_per_second", double(count) / (paint_full.mean_ms / 1000.0) });
+    results.push_back(paint_full);
+
+    results.push_back(measure("paint_cached" + suffix, iterations,
+        [&](int) {},
+        [&](int) { canvas.repaint(); }));
+
+    // Same frame with the profiler recording, against paint_full for its overhead
+    Profiler::instance().set_enabled(true);
+    results.push_back(measure("paint_full_profiled" + suffix, iterations,
+        [&](int) { canvas.invalidate(); },
+        [&](int) { canvas.repaint(); }));
+    Profiler::instance().set_enabled(false);
+    Profiler::instance().reset();
+
+    std::mt19937 random(2);
+    std::uniform_int_distribution<int> xs(0, CANVAS_WIDTH - 1);
+    std::uniform_int_distribution<int> ys(0, CANVAS_HEIGHT - 1);
+    std::vector<QPoint> clicks;
+    for (int i = 0; i < iterations; ++i) clicks.push_back(QPoint(xs(random), ys(random)));
+
+    results.push_back(measure("hit_test_click" + suffix, iterations,
+        [&](int) {},
+        [&](int i) { send_click(&canvas, clicks[size_t(i)]); }));
+
+    // Baselines for the two results above: the container traffic of paint and
+    // click from before get_all() returned a reference. Drawing is left out,
+    // so only the copies and temporaries are compared
+    results.push_back(measure("paint_get_all_copy" + suffix, iterations,
+        [&](int) {},
+        [&](int) {
+            size_t visited = 0;
+            for (int pass = 0; pass < 2; ++pass) {
+                std::vector<Shape*> all = container.get_all();
+                for (Shape* shape : all) visited += shape->get_selected() == (pass == 1);
+            }
+            if (visited != container.size()) std::abort();
+        }));
+    results.push_back(measure("click_get_all_copy" + suffix, iterations,
+        [&](int) {},
+        [&](int i) {
+            std::vector<Shape*> shapes_at_point;
+            container.shapes_at(clicks[size_t(i)], shapes_at_point);
+            if (shapes_at_point.empty()) return;
+            for (Shape* shape : std::vector<Shape*>(container.get_all())) shape->set_selected(false);
+            for (Shape* shape : shapes_at_point) shape->set_selected(true);
+            std::vector<QString> selected_types;
+            for (Shape* shape : shapes_at_point) {
+                std::string_view name = Shape::get_shape_type_name(shape);
+                selected_types.push_back(QString::fromUtf8(name.data(), int(name.size())));
+            }
+        }));
+
+    // Clicks through the grid against the linear scan over every shape that
+    // the grid replaced, as clicks per second
+    const size_t CLICK_BATCH = 1000;
+    std::vector<QPoint> batch(CLICK_BATCH);
+    for (QPoint& click : batch) click = QPoint(xs(random), ys(random));
+    std::vector<Shape*> hits;
+    Result grid_clicks = measure("click_grid" + suffix, iterations,
+        [&](int) {},
+        [&](int) {
+            for (const QPoint& click : batch) {
+                hits.clear();
+                container.shapes_at(click, hits);
+            }
+        });
+    grid_clicks.counters.push_back({ "clicks_per_second", double(CLICK_BATCH) / (grid_clicks.mean_ms / 1000.0) });
+    results.push_back(grid_clicks);
+
+    Result scan_clicks = measure("click_linear_scan" + suffix, iterations,
+        [&](int) {},
+        [&](int) {
+            for (const QPoint& click : batch) {
+                hits.clear();
+                for (Shape* shape : container) {
+                    if (shape->contains(click)) hits.push_back(shape);
+                }
+            }
+        });
+    scan_clicks.counters.push_back({ "clicks_per_second", double(CLICK_BATCH) / (scan_clicks.mean_ms / 1000.0) });
+    results.push_back(scan_clicks);
+
+    std::vector<quint64> mask;
+    results.push_back(measure("hit_test_mask" + suffix, iterations,
+        [&](int) {},
+        [&](int i) { container.hit_test(clicks[size_t(i)], mask); }));
+
+    results.push_back(drag_region(canvas, "select", "rubber_band_move" + suffix));
+    results.push_back(drag_region(canvas, "lasso", "lasso_move" + suffix));
+
+    // Selection changes up to the repainted frame; a plain click with everything
+    // selected deselects the whole scene, a Ctrl+click toggles the shapes under it
+    results.push_back(measure("select_all" + suffix, iterations,
+        [&](int) { container.set_all_selected(false); canvas.invalidate(); canvas.repaint(); },
+        [&](int) { canvas.select_all(); canvas.repaint(); }));
+
+    results.push_back(measure("deselect_click" + suffix, iterations,
+        [&](int) { canvas.select_all(); canvas.repaint(); },
+        [&](int i) { send_click(&canvas, clicks[size_t(i)]); canvas.repaint(); }));
+
+    results.push_back(measure("toggle_click" + suffix, iterations,
+        [&](int) { canvas.select_all(); canvas.repaint(); },
+        [&](int i) { send_click(&canvas, clicks[size_t(i)], Qt::ControlModifier); canvas.repaint(); }));
+
+    // One selected shape nudged by an arrow key, up to the repainted frame; only
+    // its damaged rects are redrawn
+    results.push_back(measure("edit_single_shape" + suffix, iterations,
+        [&](int i) {
+            container.set_all_selected(false);
+            container.get_all()[size_t(i) * 7919 % count]->set_selected(true);
+            canvas.invalidate();
+            canvas.repaint();
+        },
+        [&](int i) {
+            send_key(&canvas, i % 2 ? Qt::Key_Left : Qt::Key_Right, Qt::NoModifier);
+            canvas.apply_pending_input();
+            QCoreApplication::processEvents();
+        }));
+
+    // The whole scene moved and resized by arrow keys, up to the repainted frame
+    canvas.select_all();
+    canvas.repaint();
+    results.push_back(measure("move_selection" + suffix, iterations,
+        [&](int) {},
+        [&](int i) {
+            send_key(&canvas, i % 2 ? Qt::Key_Left : Qt::Key_Right, Qt::NoModifier);
+            canvas.apply_pending_input();
+            canvas.repaint();
+        }));
+
+    results.push_back(measure("resize_selection" + suffix, iterations,
+        [&](int) {},
+        [&](int i) {
+            send_key(&canvas, i % 2 ? Qt::Key_Left : Qt::Key_Right, Qt::ShiftModifier);
+            canvas.apply_pending_input();
+            canvas.repaint();
+        }));
+
+    results.push_back(replay_key_hold(canvas, Qt::NoModifier, "replay_arrow_hold" + suffix));
+    results.push_back(replay_key_hold(canvas, Qt::ShiftModifier, "replay_shift_arrow_hold" + suffix));
+    results.push_back(replay_edge_drag(canvas, "replay_edge_drag" + suffix));
+
+    // The bulk pass alone, over the geometry arrays: the scene is pulled into a
+    // smaller canvas and put back untimed between iterations
+    std::vector<QPoint> positions;
+    positions.reserve(container.size());
+    for (const Shape* shape : container) positions.push_back(QPoint(shape->get_x(), shape->get_y()));
+    auto restore_positions = [&]() {
+        const std::vector<Shape*>& shapes = container.get_all();
+        for (size_t slot = 0; slot < shapes.size(); ++slot) {
+            shapes[slot]->set_geometry(positions[slot].x(), positions[slot].y(),
+                shapes[slot]->get_width(), shapes[slot]->get_height());
+        }
+    };
+    Result adjust = measure("adjust_to_bounds" + suffix, iterations,
+        [&](int) { restore_positions(); },
+        [&](int) { container.adjust_to_bounds(CANVAS_WIDTH * 3 / 4, CANVAS_HEIGHT * 3 / 4); });
+    // x, y, width and height are read for every shape
+    adjust.counters.push_back({ "gb_per_second", double(count) * 4 * sizeof(int) / (adjust.mean_ms / 1000.0) / 1e9 });
+    results.push_back(adjust);
+
+    // Alternate between a smaller canvas, which pulls shapes in, and the full one
+    results.push_back(measure("canvas_resize" + suffix, iterations,
+        [&](int) {},
+        [&](int i) {
+            if (i % 2) canvas.resize(CANVAS_WIDTH, CANVAS_HEIGHT);
+            else canvas.resize(CANVAS_WIDTH * 3 / 4, CANVAS_HEIGHT * 3 / 4);
+            canvas.apply_pending_input();
+        }));
+    canvas.resize(CANVAS_WIDTH, CANVAS_HEIGHT);
+    canvas.apply_pending_input();
+
+    // Shrinking the canvas with Info logging on. Every iteration starts from the
+    // original positions, so the same shapes are pulled in each time; the writer
+    // thread drains the records untimed, into the discarded std::cout (see main)
+    ShapeLog& log = ShapeLog::instance();
+    log.set_level(LogLevel::Info);
+    results.push_back(measure("canvas_resize_logged" + suffix, iterations,
+        [&](int) {
+            canvas.resize(CANVAS_WIDTH, CANVAS_HEIGHT);
+            canvas.apply_pending_input();
+            restore_positions();
+            log.flush();
+        },
+        [&](int) {
+            canvas.resize(CANVAS_WIDTH * 3 / 4, CANVAS_HEIGHT * 3 / 4);
+            canvas.apply_pending_input();
+        }));
+    log.flush();
+    log.set_level(LogLevel::Off);
+    canvas.resize(CANVAS_WIDTH, CANVAS_HEIGHT);
+    canvas.apply_pending_input();
+
+    // Every iteration deletes half of the scene and tops it up again untimed
+    results.push_back(measure("clear_selected" + suffix, iterations,
+        [&](int i) {
+            if (container.size() < count) {
+                populate(container, kind, count - container.size(), quint32(3 + i));
+            }
+            container.set_all_selected(false);
+            const std::vector<Shape*>& shapes = container.get_all();
+            for (size_t slot = 0; slot < shapes.size(); slot += 2) {
+                shapes[slot]->set_selected(true);
+            }
+        },
+        [&](int) { container.clear_selected(); }));
+}
+
+// Frame time zoomed into a small region of a large world. The world grows with
+// the shape count at a fixed density, so the view always holds about the same
+// number of shapes and the frame time should not depend on the count
+void run_zoomed_world(size_t count, int iterations, std::vector<Result>& results) {
+    const int AREA_PER_SHAPE = 400;
+    int side = int(std::sqrt(double(count) * AREA_PER_SHAPE));
+    std::mt19937 random(10);
+    std::uniform_int_distribution<int> coordinate(0, side);
+
+    CanvasWidget canvas;
+    canvas.resize(CANVAS_WIDTH, CANVAS_HEIGHT);
+    canvas.show();
+    ShapesContainer& container = canvas.get_shapes_container();
+    container.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        container.create(ShapeKind(i % size_t(ShapeKind::Unknown)), coordinate(random), coordinate(random));
+    }
+    // 4x around the window centre: a 480x270 region of the world
+    canvas.zoom_in();
+    canvas.zoom_in();
+    QCoreApplication::processEvents();
+
+    Result result = measure("zoomed_frame/" + std::to_string(count), iterations,
+        [&](int) { canvas.invalidate(); },
+        [&](int) { canvas.repaint(); });
+    result.counters.push_back({ "world_side", double(side) });
+    results.push_back(result);
+}
+
+// Shape lifetime at 1M shapes: creating them, removing every one of them
+// singly, deleting the whole scene as a selection, and deleting half of it
+void run_lifetime(int iterations, std::vector<Result>& results) {
+    const size_t SHAPES = 1000000;
+    std::string suffix = "/" + std::to_string(SHAPES);
+    std::mt19937 random(8);
+    std::uniform_int_distribution<int> xs(10, CANVAS_WIDTH - 110);
+    std::uniform_int_distribution<int> ys(10, CANVAS_HEIGHT - 110);
+    std::vector<QPoint> positions(SHAPES);
+    for (QPoint& position : positions) position = QPoint(xs(random), ys(random));
+
+    ShapesContainer container;
+    auto fill = [&]() {
+        container.clear();
+        container.reserve(SHAPES);
+        for (size_t i = 0; i < SHAPES; ++i) {
+            container.create(ShapeKind(i % size_t(ShapeKind::Unknown)), positions[i].x(), positions[i].y());
+        }
+    };
+
+    Result create = measure("create_shapes" + suffix, iterations,
+        [&](int) { container.clear(); },
+        [&](int) { fill(); });
+    create.counters.push_back({ "shapes_per_second", double(SHAPES) / (create.mean_ms / 1000.0) });
+    results.push_back(create);
+
+    // Single removes: the last shape moves into the freed slot, until the
+    // scene is empty
+    Result remove = measure("remove_single" + suffix, iterations,
+        [&](int) { fill(); },
+        [&](int) {
+            while (container.size() > 0) container.remove(container.get_all().front());
+        });
+    remove.counters.push_back({ "removes_per_second", double(SHAPES) / (remove.mean_ms / 1000.0) });
+    results.push_back(remove);
+
+    results.push_back(measure("delete_all_selected" + suffix, iterations,
+        [&](int) {
+            fill();
+            container.set_all_selected(true);
+        },
+        [&](int) { container.clear_selected(); }));
+
+    results.push_back(measure("delete_half_selected" + suffix, iterations,
+        [&](int) {
+            fill();
+            const std::vector<Shape*>& shapes = container.get_all();
+            for (size_t slot = 0; slot < shapes.size(); slot += 2) shapes[slot]->set_selected(true);
+        },
+        [&](int) { container.clear_selected(); }));
+}
+
+// Undo history growth over 10k edits of single shapes in a 1M-shape scene:
+// each shape is moved with an arrow key, recolored and every other one
+// deleted. Then undoing and redoing the deletion of half the scene, which
+// puts the shapes back at their old places in drawing order.
+void run_history(int iterations, std::vector<Result>& results) {
+    const size_t SHAPES = 1000000;
+    const size_t OPERATIONS = 10000;
+    std::string suffix = "/" + std::to_string(SHAPES);
+    CanvasWidget canvas;
+    canvas.resize(CANVAS_WIDTH, CANVAS_HEIGHT);
+    ShapesContainer& container = canvas.get_shapes_container();
+    populate(container, "mixed", SHAPES, 9);
+
+    size_t operations = 0;
+    size_t rounds = 0;
+    size_t selection = 0;
+    Result memory = measure("history_memory" + suffix + "/operations:" + std::to_string(OPERATIONS), 1,
+        [&](int) {},
+        [&](int) {
+            while (operations < OPERATIONS) {
+                selection = (selection + 7919) % container.size();
+                Shape* shape = container.get_all()[selection];
+                shape->set_selected(true);
+
+                send_key(&canvas, Qt::Key_Right, Qt::NoModifier);
+                canvas.change_selected_shapes_color(QColor::fromRgb(QRgb(0xff000000u | quint32(rounds))));
+                operations += 2;
+                if (++rounds % 2 == 0) {
+                    send_key(&canvas, Qt::Key_Delete, Qt::NoModifier);
+                    ++operations;
+                }
+                else {
+                    shape->set_selected(false);
+                }
+            }
+        });
+    size_t bytes = canvas.get_history().memory();
+    memory.counters.push_back({ "operations", double(operations) });
+    memory.counters.push_back({ "history_bytes", double(bytes) });
+    memory.counters.push_back({ "bytes_per_10k_operations", double(bytes) * 10000.0 / double(operations) });
+    results.push_back(memory);
+
+    const std::vector<Shape*>& shapes = container.get_all();
+    for (size_t slot = 0; slot < shapes.size(); slot += 2) shapes[slot]->set_selected(true);
+    send_key(&canvas, Qt::Key_Delete, Qt::NoModifier);
+
+    results.push_back(measure("history_undo_delete_half" + suffix, iterations,
+        [&](int) {},
+        [&](int) {
+            canvas.undo();
+            canvas.redo();
+        }));
+}
+
+// 1, 2, 4, ... threads up to every hardware thread
+std::vector<int> thread_sweep() {
+    int hardware = std::max(1, int(std::thread::hardware_concurrency()));
+    std::vector<int> counts;
+    for (int threads = 1; threads < hardware; threads *= 2) counts.push_back(threads);
+    counts.push_back(hardware);
+    return counts;
+}
+
+const size_t SWEEP_SHAPES = 1000000;
+
+// Tiled export of a 1M-shape scene on 1..N threads; speedup is against one thread
+void run_render_sweep(int iterations, std::vector<Result>& results) {
+    CanvasWidget canvas;
+    canvas.resize(CANVAS_WIDTH, CANVAS_HEIGHT);
+    populate(canvas.get_shapes_container(), "mixed", SWEEP_SHAPES, 6);
+
+    double single_ms = 0.0;
+    for (int threads : thread_sweep()) {
+        Result result = measure("render_to_image/" + std::to_string(SWEEP_SHAPES) + "/threads:" +
+            std::to_string(threads), iterations,
+            [&](int) {},
+            [&](int) { canvas.render_to_image(threads); });
+        if (threads == 1) single_ms = result.mean_ms;
+        result.counters.push_back({ "threads", double(threads) });
+        result.counters.push_back({ "speedup", single_ms / result.mean_ms });
+        results.push_back(result);
+    }
+}
+
+// Moving a 1M-shape selection with a WorkerPool of 1..N threads, by one pixel
+// (few shapes change grid cells) and by a whole cell (every shape does)
+void run_translate_sweep(int iterations, std::vector<Result>& results) {
+    ShapesContainer container;
+    populate(container, "mixed", SWEEP_SHAPES, 7);
+    container.set_all_selected(true);
+
+    for (int step : { 1, SpatialGrid::CELL_SIZE }) {
+        std::string name = step == 1 ? "translate_selected/" : "translate_selected_cross_cells/";
+        double single_ms = 0.0;
+        for (int threads : thread_sweep()) {
+            WorkerPool pool(threads);
+            Result result = measure(name + std::to_string(SWEEP_SHAPES) + "/threads:" +
+                std::to_string(threads), iterations,
+                [&](int) {},
+                [&](int i) {
+                    // Even iterations move right, so the canvas needs room for one step
+                    container.translate_selected(i % 2 ? -step : step, 0, CANVAS_WIDTH + step, CANVAS_HEIGHT, &pool);
+                });
+            if (threads == 1) single_ms = result.mean_ms;
+            result.counters.push_back({ "threads", double(threads) });
+            result.counters.push_back({ "speedup", single_ms / result.mean_ms });
+            results.push_back(result);
+        }
+    }
+}
+
+// Opening a saved drawing: load_document maps the file and shows it before
+// building the shapes in steps, import streams it through a fixed-size buffer
+void run_document_load(size_t count, int iterations, std::vector<Result>& results) {
+    std::string suffix = "/" + std::to_string(count);
+    QTemporaryDir directory;
+    QString path = directory.filePath("scene.shpd");
+    {
+        ShapesContainer container;
+        populate(container, "mixed", count, 1);
+        if (!ShapeDocument::save(container, path)) {
+            std::cerr << "Cannot write " << path.toStdString() << "\n";
+            return;
+        }
+    }
+
+    CanvasWidget canvas;
+    canvas.resize(CANVAS_WIDTH, CANVAS_HEIGHT);
+    canvas.show();
+    QCoreApplication::processEvents();
+
+    // Until the drawing is on screen; the event loop stays blocked only this long
+    results.push_back(measure("document_first_frame" + suffix, iterations,
+        [&](int) {},
+        [&](int) {
+            canvas.load_document(path);
+            canvas.repaint();
+        }));
+
+    Result mapped = measure("document_load_mapped" + suffix, iterations,
+        [&](int) {},
+        [&](int) {
+            canvas.load_document(path);
+            canvas.finish_loading();
+        });
+    mapped.counters.push_back({ "shapes_per_second", double(count) / (mapped.mean_ms / 1000.0) });
+    results.push_back(mapped);
+    canvas.get_shapes_container().clear();
+
+    ShapesContainer container;
+    Result streamed = measure("document_import" + suffix, iterations,
+        [&](int) { container.clear(); },
+        [&](int) { ShapeDocument::import(path, container); });
+    streamed.counters.push_back({ "shapes_per_second", double(count) / (streamed.mean_ms / 1000.0) });
+    results.push_back(streamed);
+}
+
+// Every hit-test kernel against Shape::contains, for each kind and a mixed
+// scene, with lengths that are not a multiple of the vector width and negative
+// coordinates; then the throughput of each kernel over 1M shapes. Returns
+// false on any mismatch.
+bool check_hit_test_kernels(int iterations, std::vector<Result>& results) {
+    const std::pair<HitTestIsa, std::string> isas[] = {
+        { HitTestIsa::Scalar, "scalar" }, { HitTestIsa::Sse2, "sse2" }, { HitTestIsa::Avx2, "avx2" } };
+    const size_t KINDS = size_t(ShapeKind::Unknown);
+    std::mt19937 random(4);
+    std::uniform_int_distribution<int> coordinate(-300, 300);
+    std::uniform_int_distribution<int> extent(1, 120);
+    std::vector<quint64> mask;
+    size_t mismatches = 0;
+
+    for (size_t kind = 0; kind <= KINDS; ++kind) { // KINDS stands for the mixed scene
+        for (size_t count : { 1, 7, 9, 63, 65, 1003 }) {
+            ShapesContainer container;
+            for (size_t i = 0; i < count; ++i) {
+                Shape* shape = container.create(ShapeKind(kind < KINDS ? kind : i % KINDS), 0, 0);
+                shape->set_geometry(coordinate(random), coordinate(random), extent(random), extent(random));
+            }
+            const std::vector<Shape*>& shapes = container.get_all();
+            for (int click = 0; click < 200; ++click) {
+                QPoint point(coordinate(random), coordinate(random));
+                for (const auto& [isa, isa_name] : isas) {
+                    if (!ShapesContainer::use_hit_test_isa(isa)) continue;
+                    container.hit_test(point, mask);
+                    for (size_t slot = 0; slot < shapes.size(); ++slot) {
+                        bool hit = (mask[slot >> 6] >> (slot & 63)) & 1;
+                        if (hit == shapes[slot]->contains(point)) continue;
+                        if (++mismatches <= 10) {
+                            std::cerr << "hit_test " << isa_name << ": " << shape_kind_names[size_t(shapes[slot]->get_kind())]
+                                << " at slot " << slot << " of " << count << ", point " << point.x() << "," << point.y()
+                                << ": kernel " << hit << ", contains " << !hit << "\n";
+                        }
+                    }
+                }
+            }
+        }
+    }
+    Result check = { "hit_test_kernel_check", 1, 0.0, 0.0, 0.0, { { "mismatches", double(mismatches) } } };
+    results.push_back(check);
+
+    const size_t SHAPES = 1000000;
+    const size_t POINTS = 100;
+    ShapesContainer container;
+    populate(container, "mixed", SHAPES, 5);
+    std::vector<QPoint> points(POINTS);
+    for (QPoint& point : points) point = QPoint(coordinate(random) + CANVAS_WIDTH / 2, coordinate(random) + CANVAS_HEIGHT / 2);
+    for (const auto& [isa, isa_name] : isas) {
+        if (!ShapesContainer::use_hit_test_isa(isa)) continue;
+        Result result = measure("hit_test_kernel/" + isa_name + "/" + std::to_string(SHAPES), iterations,
+            [&](int) {},
+            [&](int) { container.hit_test(points, mask); });
+        result.counters.push_back({ "tests_per_second", double(SHAPES * POINTS) / (result.mean_ms / 1000.0) });
+        results.push_back(result);
+    }
+    ShapesContainer::use_hit_test_isa(HitTestIsa::Auto);
+    return mismatches == 0;
+}
+
+// Cost of the probes themselves; disabled scopes pay one relaxed load and a
+// test of the cached flag on exit
+Result measure_profile_scopes(bool enabled, size_t scopes, int iterations) {
+    Profiler& profiler = Profiler::instance();
+    profiler.set_enabled(enabled);
+    volatile size_t sink = 0;
+    Result result = measure(std::string("profile_scope_") + (enabled ? "enabled" : "disabled") + "/" +
+        std::to_string(scopes), iterations,
+        [&](int) { profiler.reset(); },
+        [&](int) {
+            for (size_t i = 0; i < scopes; ++i) {
+                ProfileScope scope(ProfileZone::Paint);
+                sink = sink + i;
+            }
+        });
+    profiler.set_enabled(false);
+    profiler.reset();
+    result.counters.push_back({ "ns_per_scope", result.mean_ms * 1e6 / double(scopes) });
+    return result;
+}
+
+std::string escape_json(const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+void write_json(std::ostream& out, const std::vector<Result>& results) {
+    out << std::setprecision(6) << std::fixed;
+    out << "{\n  \"context\": {\n"
+        << "    \"date\": \"" << QDateTime::currentDateTime().toString(Qt::ISODate).toStdString() << "\",\n"
+        << "    \"host_name\": \"" << escape_json(QSysInfo::machineHostName().toStdString()) << "\",\n"
+        << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ",\n"
+        << "    \"qt_version\": \"" << qVersion() << "\",\n"
+        << "    \"library_build_type\": \""
+#ifdef NDEBUG
+        << "release"
+#else
+        << "debug"
+#endif
+        << "\"\n  },\n  \"benchmarks\": [\n";
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        out << "    {\n"
+            << "      \"name\": \"" << escape_json(r.name) << "\",\n"
+            << "      \"run_type\": \"iteration\",\n"
+            << "      \"iterations\": " << r.iterations << ",\n"
+            << "      \"real_time\": " << r.mean_ms << ",\n"
+            << "      \"cpu_time\": " << r.mean_ms << ",\n"
+            << "      \"min_time\": " << r.min_ms << ",\n"
+            << "      \"max_time\": " << r.max_ms << ",\n";
+        for (const auto& [counter, value] : r.counters) {
+            out << "      \"" << escape_json(counter) << "\": " << value << ",\n";
+        }
+        out << "      \"time_unit\": \"ms\"\n"
+            << "    }" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    // The log writer prints to std::cout; it is pointed at a null buffer before
+    // the writer thread starts, and the JSON goes to the real stdout
+    static NullBuffer null_buffer;
+    std::ostream console(std::cout.rdbuf(&null_buffer));
+    QApplication app(argc, argv);
+    ShapeLog::instance().set_level(LogLevel::Off);
+
+    Options options = parse_options(app.arguments());
+    std::vector<Result> results;
+    results.push_back(measure_profile_scopes(false, 1000000, options.iterations));
+    results.push_back(measure_profile_scopes(true, 1000000, options.iterations));
+    bool kernels_match = check_hit_test_kernels(options.iterations, results);
+    for (size_t count : options.world_counts) {
+        std::cerr << "Running zoomed world x " << count << "\n";
+        run_zoomed_world(count, options.iterations, results);
+    }
+    std::cerr << "Running shape lifetime\n";
+    run_lifetime(options.iterations, results);
+    std::cerr << "Running history\n";
+    run_history(options.iterations, results);
+    std::cerr << "Running thread sweeps\n";
+    run_render_sweep(options.iterations, results);
+    run_translate_sweep(options.iterations, results);
+    for (const QString& kind : options.kinds) {
+        for (size_t count : options.counts) {
+            std::cerr << "Running " << kind.toStdString() << " x " << count << "\n";
+            run_scene(options, kind, count, results);
+        }
+    }
+
+    for (size_t count : options.document_counts) {
+        std::cerr << "Running document load x " << count << "\n";
+        run_document_load(count, options.iterations, results);
+    }
+
+    if (options.out.isEmpty()) {
+        write_json(console, results);
+        return kernels_match ? 0 : 1;
+    }
+    std::ofstream file(options.out.toStdString());
+    if (!file) {
+        std::cerr << "Cannot write " << options.out.toStdString() << "\n";
+        return 1;
+    }
+    write_json(file, results);
+    return kernels_match ? 0 : 1;
+}
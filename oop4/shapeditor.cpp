@@ -1,500 +1,3177 @@
 #include "shapeditor.h"
 
+#if defined(__x86_64__) || defined(_M_X64)
+#define SHAPE_HIT_TEST_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SHAPE_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define SHAPE_TARGET_AVX2
+#endif
+
+// ShapeLog implementation
+ShapeLog& ShapeLog::instance() {
+    static ShapeLog log;
+    return log;
+}
+
+ShapeLog::ShapeLog() : min_level(LogLevel::Info), cells(new Cell[CAPACITY]),
+enqueue_pos(0), dequeue_pos(0), dropped(0), flushed_pos(0), stopping(false), run_length(0) {
+    for (size_t i = 0; i < CAPACITY; ++i) {
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // SHAPE_EDITOR_LOG=debug|info|warning|off
+    if (const char* level = std::getenv("SHAPE_EDITOR_LOG")) {
+        std::string_view name(level);
+        if (name == "debug") min_level = LogLevel::Debug;
+        else if (name == "warning") min_level = LogLevel::Warning;
+        else if (name == "off") min_level = LogLevel::Off;
+    }
+
+    run.reserve(COALESCE_LIMIT);
+    writer = std::thread(&ShapeLog::writer_loop, this);
+}
+
+ShapeLog::~ShapeLog() {
+    stopping = true;
+    writer.join();
+}
+
+// Bounded multi-producer queue (Vyukov): each cell's sequence tells whether
+// it is free for the producer at `pos` or filled for the consumer at `pos`
+bool ShapeLog::try_push(const LogRecord& record) {
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+        cell = &cells[pos & (CAPACITY - 1)];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        intptr_t diff = intptr_t(sequence) - intptr_t(pos);
+        if (diff == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        }
+        else if (diff < 0) {
+            return false; // full
+        }
+        else {
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    cell->record = record;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool ShapeLog::try_pop(LogRecord& record) {
+    // Single consumer: only the writer thread advances dequeue_pos
+    size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    Cell& cell = cells[pos & (CAPACITY - 1)];
+    if (cell.sequence.load(std::memory_order_acquire) != pos + 1) return false;
+
+    record = cell.record;
+    cell.sequence.store(pos + CAPACITY, std::memory_order_release);
+    dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+    return true;
+}
+
+void ShapeLog::write(LogLevel level, LogEvent event, ShapeKind kind,
+    int a, int b, int c, int d, bool starts_list) {
+    if (!try_push({ event, level, kind, starts_list, a, b, c, d })) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void ShapeLog::write_text(LogLevel level, const std::string& text) {
+    if (!enabled(level)) return;
+    // The text is queued only once its record is in the ring, so a dropped record
+    // leaves no orphan behind; the writer takes the same lock before reading it
+    std::lock_guard<std::mutex> lock(text_mutex);
+    if (!try_push({ LogEvent::Text, level, ShapeKind::Unknown, false, 0, 0, 0, 0 })) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    texts.push_back(text);
+}
+
+void ShapeLog::flush() {
+    size_t target = enqueue_pos.load(std::memory_order_acquire);
+    while (flushed_pos.load(std::memory_order_acquire) < target) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+void ShapeLog::writer_loop() {
+    LogRecord record;
+    while (true) {
+        bool any = false;
+        while (try_pop(record)) {
+            any = true;
+            consume(record);
+        }
+        if (any) continue;
+
+        // Queue is drained: finish the pending run and report losses
+        flush_run();
+        if (size_t lost = dropped.exchange(0)) {
+            std::cout << "(" << lost << " log records dropped)\n";
+        }
+        std::cout.flush();
+        flushed_pos.store(dequeue_pos.load(std::memory_order_relaxed), std::memory_order_release);
+
+        if (stopping) return;
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+}
+
+void ShapeLog::consume(const LogRecord& record) {
+    if (run_length > 0 && (record.event != run.front().event || record.starts_list ||
+        record.event == LogEvent::Text)) {
+        flush_run();
+    }
+    if (run.size() < COALESCE_LIMIT) {
+        run.push_back(record);
+    }
+    else {
+        run.back() = record; // summaries report the latest values
+    }
+    ++run_length;
+}
+
+static std::string group_thousands(size_t value) {
+    std::string digits = std::to_string(value);
+    for (int i = int(digits.size()) - 3; i > 0; i -= 3) {
+        digits.insert(size_t(i), ",");
+    }
+    return digits;
+}
+
+static std::string color_name(int rgba) {
+    static const char hex[] = "0123456789abcdef";
+    std::string name = "#";
+    for (int shift = 20; shift >= 0; shift -= 4) {
+        name += hex[(quint32(rgba) >> shift) & 0xF];
+    }
+    return name;
+}
+
+void ShapeLog::flush_run() {
+    if (run_length == 0) return;
+
+    const LogRecord& last = run.back();
+    bool is_list = last.event == LogEvent::Deleted || last.event == LogEvent::Selected ||
+        last.event == LogEvent::Toggled || last.event == LogEvent::ColorChanged;
+
+    if (run_length > COALESCE_LIMIT) {
+        std::string count = group_thousands(run_length);
+        switch (last.event) {
+        case LogEvent::Moved: std::cout << "Moved " << count << " shapes\n"; break;
+        case LogEvent::MoveBlocked: std::cout << "Attempt to go out of bounds: " << count << " shapes tried to go beyond canvas!\n"; break;
+        case LogEvent::Resized: std::cout << "Resized " << count << " shapes\n"; break;
+        case LogEvent::ResizeBlocked: std::cout << "Attempt to go out of bounds: failed to resize " << count << " shapes\n"; break;
+        case LogEvent::Adjusted: std::cout << "Adjusted " << count << " shapes when canvas resized\n"; break;
+        case LogEvent::Created: std::cout << "Created " << count << " shapes\n"; break;
+        case LogEvent::Deleted: std::cout << "Deleted " << count << " selected shapes\n"; break;
+        case LogEvent::Selected: std::cout << "Selection selected for " << count << " shapes\n"; break;
+        case LogEvent::Toggled: std::cout << "Selection toggled for " << count << " shapes\n"; break;
+        case LogEvent::ColorChanged: std::cout << "Changed color for " << count << " shapes to " << color_name(last.a) << "\n"; break;
+        default:
+            for (const LogRecord& record : run) print(record);
+            std::cout << "(" << count << " similar messages)\n";
+            break;
+        }
+    }
+    else if (is_list) {
+        switch (last.event) {
+        case LogEvent::Deleted: std::cout << "Deleted selected shapes: "; break;
+        case LogEvent::Selected: std::cout << "Selection selected for shapes: "; break;
+        case LogEvent::Toggled: std::cout << "Selection toggled for shapes: "; break;
+        default: std::cout << "Changed color for shapes: "; break;
+        }
+        const char* separator = "";
+        for (const LogRecord& record : run) {
+            std::cout << separator << shape_kind_names[size_t(record.kind)];
+            separator = ", ";
+        }
+        if (last.event == LogEvent::ColorChanged) {
+            std::cout << " to " << color_name(last.a);
+        }
+        std::cout << "\n";
+    }
+    else {
+        for (const LogRecord& record : run) print(record);
+    }
+
+    run.clear();
+    run_length = 0;
+}
+
+// Indexed by EditCommand::Type
+static const char* const edit_names[] = { "creation", "deletion", "move", "resize", "color change", "adjustment" };
+
+void ShapeLog::print(const LogRecord& r) {
+    std::string_view name = shape_kind_names[size_t(r.kind)];
+    switch (r.event) {
+    case LogEvent::Moved:
+        std::cout << "Shape " << name << " moved from (" << r.a << ", " << r.b
+            << ") to (" << r.c << ", " << r.d << ")\n";
+        break;
+    case LogEvent::MoveBlocked:
+        std::cout << "Attempt to go out of bounds: " << name << " tried to go beyond canvas!\n";
+        break;
+    case LogEvent::Resized:
+        std::cout << "Shape " << name << " resized from (" << r.a << ", " << r.b
+            << ") to (" << r.c << ", " << r.d << ")\n";
+        break;
+    case LogEvent::ResizeBlocked:
+        std::cout << "Attempt to go out of bounds: failed to resize " << name
+            << " by " << r.a << ", " << r.b << "\n";
+        break;
+    case LogEvent::Adjusted:
+        std::cout << "Shape " << name << " adjusted when canvas resized: from (" << r.a << ", " << r.b
+            << ") to (" << r.c << ", " << r.d << ")\n";
+        break;
+    case LogEvent::Created:
+        std::cout << "Created shape " << name << " at position (" << r.a << ", " << r.b
+            << ") with size (" << r.c << ", " << r.d << ")\n";
+        break;
+    case LogEvent::Deselected:
+        std::cout << "Deselected all shapes\n";
+        break;
+    case LogEvent::CanvasResized:
+        std::cout << "Canvas changed from " << r.a << "x" << r.b << " to " << r.c << "x" << r.d << "\n";
+        break;
+    case LogEvent::SelectionDeleted:
+        std::cout << "Deleted " << group_thousands(size_t(r.a)) << " selected shapes\n";
+        break;
+    case LogEvent::ShapesAdjusted:
+        std::cout << "Adjusted " << group_thousands(size_t(r.a)) << " shapes when canvas resized to "
+            << r.b << "x" << r.c << "\n";
+        break;
+    case LogEvent::SelectionMoved:
+        std::cout << "Moved " << group_thousands(size_t(r.a)) << " selected shapes by (" << r.b << ", " << r.c << ")\n";
+        break;
+    case LogEvent::SelectionResized:
+        std::cout << "Resized " << group_thousands(size_t(r.a)) << " selected shapes by (" << r.b << ", " << r.c << ")\n";
+        break;
+    case LogEvent::SelectionBlocked:
+        std::cout << "Attempt to go out of bounds: " << group_thousands(size_t(r.a)) << " selected shapes can't change by ("
+            << r.b << ", " << r.c << ")\n";
+        break;
+    case LogEvent::SelectionRecolored:
+        std::cout << "Changed color for " << group_thousands(size_t(r.b)) << " selected shapes to " << color_name(r.a) << "\n";
+        break;
+    case LogEvent::RegionSelected:
+        std::cout << (r.b ? "Lasso" : "Rubber band") << " selection: " << r.a << " shapes selected\n";
+        break;
+    case LogEvent::Undone:
+    case LogEvent::Redone:
+        std::cout << (r.event == LogEvent::Undone ? "Undid " : "Redid ") << edit_names[r.a]
+            << " of " << r.b << " shapes\n";
+        break;
+    case LogEvent::Text: {
+        std::string text;
+        {
+            std::lock_guard<std::mutex> lock(text_mutex);
+            if (texts.empty()) break;
+            text = std::move(texts.front());
+            texts.pop_front();
+        }
+        std::cout << text << "\n";
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// Profiler implementation
+Profiler& Profiler::instance() {
+    static Profiler profiler;
+    return profiler;
+}
+
+Profiler::Profiler() : epoch_ns(now()), frame_count(0) {}
+
+quint64 Profiler::now() {
+    return quint64(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+void Profiler::record(ProfileZone zone, quint64 start_ns, quint64 duration_ns) {
+    ZoneStats& stats = zones[size_t(zone)];
+    ++stats.calls;
+    stats.total_ns += duration_ns;
+    stats.max_ns = std::max(stats.max_ns, duration_ns);
+    stats.last_ns = duration_ns;
+
+    int bucket = 0;
+    for (quint64 us = duration_ns / 1000; us > 1 && bucket < HISTOGRAM_BUCKETS - 1; us >>= 1) {
+        ++bucket;
+    }
+    ++stats.histogram[bucket];
+
+    if (trace.size() < MAX_TRACE_EVENTS) {
+        trace.push_back({ start_ns, duration_ns, qint32(zone), 0 });
+    }
+}
+
+void Profiler::end_frame() {
+    ++frame_count;
+    std::copy(std::begin(frame_counters), std::end(frame_counters), std::begin(frame_totals));
+    std::fill(std::begin(frame_counters), std::end(frame_counters), 0);
+
+    if (trace.size() < MAX_TRACE_EVENTS) {
+        trace.push_back({ now(), 0, -1, quint32(trace_counters.size()) });
+        trace_counters.insert(trace_counters.end(), std::begin(frame_totals), std::end(frame_totals));
+    }
+}
+
+double Profiler::ZoneStats::percentile_ms(double fraction) const {
+    quint64 target = quint64(std::ceil(double(calls) * fraction));
+    quint64 seen = 0;
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket) {
+        seen += histogram[bucket];
+        if (seen >= target && seen > 0) {
+            return double(quint64(2) << bucket) / 1000.0;
+        }
+    }
+    return double(max_ns) / 1e6;
+}
+
+void Profiler::reset() {
+    for (ZoneStats& stats : zones) stats = ZoneStats();
+    std::fill(std::begin(frame_counters), std::end(frame_counters), 0);
+    std::fill(std::begin(frame_totals), std::end(frame_totals), 0);
+    frame_count = 0;
+    trace.clear();
+    trace_counters.clear();
+    epoch_ns = now();
+}
+
+bool Profiler::export_chrome_trace(const QString& path) const {
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) return false;
+
+    // Timestamps are microseconds since the profiler started or was reset
+    std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    char line[256];
+    const char* separator = "";
+    for (const TraceEvent& event : trace) {
+        double ts = double(event.start_ns - std::min(event.start_ns, epoch_ns)) / 1000.0;
+        if (event.zone >= 0) {
+            std::snprintf(line, sizeof(line),
+                "%s{\"name\":\"%s\",\"cat\":\"editor\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1}",
+                separator, profile_zone_names[event.zone].data(), ts, double(event.duration_ns) / 1000.0);
+            json += line;
+        }
+        else {
+            std::snprintf(line, sizeof(line),
+                "%s{\"name\":\"frame\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,\"tid\":1,\"args\":{", separator, ts);
+            json += line;
+            for (size_t i = 0; i < size_t(ProfileCounter::Count); ++i) {
+                std::snprintf(line, sizeof(line), "%s\"%s\":%llu", i ? "," : "",
+                    profile_counter_names[i].data(), (unsigned long long)trace_counters[event.counters_index + i]);
+                json += line;
+            }
+            json += "}}";
+        }
+        separator = ",\n";
+    }
+    json += "\n]}\n";
+
+    file.write(json.data(), qint64(json.size()));
+    return file.commit();
+}
+
+// SpatialGrid implementation
+int SpatialGrid::cell_coord(int value) {
+    // Floor division, so negative coordinates land in their own cells
+    return value >= 0 ? value / CELL_SIZE : -((-value - 1) / CELL_SIZE) - 1;
+}
+
+quint64 SpatialGrid::cell_key(int cell_x, int cell_y) {
+    return (quint64(quint32(cell_x)) << 32) | quint32(cell_y);
+}
+
+qint64 SpatialGrid::cells_spanned(const QRect& rect) {
+    return qint64(cell_coord(rect.right()) - cell_coord(rect.left()) + 1) *
+        (cell_coord(rect.bottom()) - cell_coord(rect.top()) + 1);
+}
+
+void SpatialGrid::append(const Bucket& bucket, std::vector<Shape*>& out) {
+    for (const Entry& entry : bucket) {
+        out.push_back(entry.shape);
+    }
+}
+
+void SpatialGrid::erase(Bucket& bucket, quint32 position) {
+    Entry moved = bucket.back();
+    bucket[position] = moved;
+    moved.shape->grid_entries[moved.cell] = position;
+    bucket.pop_back();
+}
+
+void SpatialGrid::insert(Shape* shape, const QRect& bounds) {
+    if (cells_spanned(bounds) > MAX_SHAPE_CELLS) {
+        shape->grid_entries[0] = quint32(large.size());
+        large.push_back({ shape, 0 });
+        return;
+    }
+
+    quint32 index = 0;
+    for (int cy = cell_coord(bounds.top()); cy <= cell_coord(bounds.bottom()); ++cy) {
+        for (int cx = cell_coord(bounds.left()); cx <= cell_coord(bounds.right()); ++cx) {
+            Bucket& bucket = cells[cell_key(cx, cy)];
+            shape->grid_entries[index] = quint32(bucket.size());
+            bucket.push_back({ shape, index });
+            ++index;
+        }
+    }
+}
+
+void SpatialGrid::remove(Shape* shape, const QRect& bounds) {
+    if (cells_spanned(bounds) > MAX_SHAPE_CELLS) {
+        erase(large, shape->grid_entries[0]);
+        return;
+    }
+
+    quint32 index = 0;
+    for (int cy = cell_coord(bounds.top()); cy <= cell_coord(bounds.bottom()); ++cy) {
+        for (int cx = cell_coord(bounds.left()); cx <= cell_coord(bounds.right()); ++cx) {
+            auto cell = cells.find(cell_key(cx, cy));
+            erase(cell->second, shape->grid_entries[index++]);
+            if (cell->second.empty()) {
+                cells.erase(cell);
+            }
+        }
+    }
+}
+
+bool SpatialGrid::same_cells(const QRect& a, const QRect& b) {
+    return cell_coord(a.left()) == cell_coord(b.left()) && cell_coord(a.right()) == cell_coord(b.right()) &&
+        cell_coord(a.top()) == cell_coord(b.top()) && cell_coord(a.bottom()) == cell_coord(b.bottom());
+}
+
+void SpatialGrid::update(Shape* shape, const QRect& old_bounds, const QRect& new_bounds) {
+    // Small moves usually stay inside the same cells
+    if (same_cells(old_bounds, new_bounds)) return;
+    remove(shape, old_bounds);
+    insert(shape, new_bounds);
+}
+
+void SpatialGrid::query(const QPoint& point, std::vector<Shape*>& out) const {
+    auto cell = cells.find(cell_key(cell_coord(point.x()), cell_coord(point.y())));
+    if (cell != cells.end()) {
+        append(cell->second, out);
+    }
+    append(large, out);
+}
+
+void SpatialGrid::query(const QRect& rect, std::vector<Shape*>& out) const {
+    int first_x = cell_coord(rect.left()), last_x = cell_coord(rect.right());
+    int first_y = cell_coord(rect.top()), last_y = cell_coord(rect.bottom());
+    append(large, out);
+
+    // Large areas: walk the occupied cells instead of every cell in the rect
+    if (cells_spanned(rect) > qint64(cells.size())) {
+        for (const auto& cell : cells) {
+            int cx = int(quint32(cell.first >> 32));
+            int cy = int(quint32(cell.first));
+            if (cx >= first_x && cx <= last_x && cy >= first_y && cy <= last_y) {
+                append(cell.second, out);
+            }
+        }
+        return;
+    }
+
+    for (int cy = first_y; cy <= last_y; ++cy) {
+        for (int cx = first_x; cx <= last_x; ++cx) {
+            auto cell = cells.find(cell_key(cx, cy));
+            if (cell != cells.end()) {
+                append(cell->second, out);
+            }
+        }
+    }
+}
+
+// SelectionSet implementation
+static int count_bits(quint64 word) {
+#if defined(_MSC_VER)
+    return int(__popcnt64(word));
+#else
+    return __builtin_popcountll(word);
+#endif
+}
+
+void SelectionSet::clear_tail() {
+    if (bit_count & 63) {
+        words.back() &= (quint64(1) << (bit_count & 63)) - 1;
+    }
+}
+
+void SelectionSet::push_back(bool value) {
+    if ((bit_count & 63) == 0) words.push_back(0);
+    ++bit_count;
+    set(bit_count - 1, value);
+}
+
+void SelectionSet::pop_back() {
+    set(bit_count - 1, false);
+    --bit_count;
+    if ((bit_count & 63) == 0) words.pop_back();
+}
+
+void SelectionSet::resize(size_t count) {
+    words.resize((count + 63) / 64, 0);
+    bit_count = count;
+    clear_tail();
+}
+
+void SelectionSet::clear() {
+    words.clear();
+    bit_count = 0;
+}
+
+void SelectionSet::fill(bool value) {
+    if (words.empty()) return;
+    std::memset(words.data(), value ? 0xFF : 0, words.size() * sizeof(quint64));
+    clear_tail();
+}
+
+size_t SelectionSet::count() const {
+    size_t total = 0;
+    for (quint64 word : words) total += size_t(count_bits(word));
+    return total;
+}
+
+bool SelectionSet::any() const {
+    for (quint64 word : words) {
+        if (word) return true;
+    }
+    return false;
+}
+
+size_t SelectionSet::next_set(size_t index) const {
+    if (index >= bit_count) return bit_count;
+    size_t w = index >> 6;
+    quint64 word = words[w] & (~quint64(0) << (index & 63));
+    while (!word) {
+        if (++w == words.size()) return bit_count;
+        word = words[w];
+    }
+    return (w << 6) + size_t(lowest_set_bit(word));
+}
+
+void SelectionSet::assign(const std::vector<quint64>& mask) {
+    std::memcpy(words.data(), mask.data(), words.size() * sizeof(quint64));
+    clear_tail();
+}
+
+void SelectionSet::unite(const std::vector<quint64>& mask) {
+    for (size_t w = 0; w < words.size(); ++w) words[w] |= mask[w];
+    clear_tail();
+}
+
+void SelectionSet::intersect(const std::vector<quint64>& mask) {
+    for (size_t w = 0; w < words.size(); ++w) words[w] &= mask[w];
+}
+
+void SelectionSet::toggle(const std::vector<quint64>& mask) {
+    for (size_t w = 0; w < words.size(); ++w) words[w] ^= mask[w];
+    clear_tail();
+}
+
+// LassoRegion implementation
+int LassoRegion::band_of(int y) {
+    return y >= 0 ? y / BAND_HEIGHT : -((-y - 1) / BAND_HEIGHT) - 1;
+}
+
+void LassoRegion::clear() {
+    points.clear();
+    bounding = QRect();
+    first_band = 0;
+    bands.clear();
+}
+
+void LassoRegion::add_point(const QPoint& point) {
+    if (!points.isEmpty()) {
+        if (points.back() == point) return;
+        int edge = int(points.size()) - 1;
+        int first = band_of(std::min(points.back().y(), point.y()));
+        int last = band_of(std::max(points.back().y(), point.y()));
+
+        // Grow the band list to cover [first, last]
+        if (bands.empty()) {
+            first_band = first;
+        }
+        else if (first < first_band) {
+            bands.insert(bands.begin(), size_t(first_band - first), std::vector<int>());
+            first_band = first;
+        }
+        if (last - first_band >= int(bands.size())) {
+            bands.resize(size_t(last - first_band + 1));
+        }
+        for (int band = first; band <= last; ++band) {
+            bands[size_t(band - first_band)].push_back(edge);
+        }
+    }
+    points.append(point);
+    bounding |= QRect(point, QSize(1, 1));
+}
+
+bool LassoRegion::contains(const QPoint& point) const {
+    if (points.size() < 3 || !bounding.contains(point)) return false;
+    bool inside = false;
+    // Count crossings of a ray going right from the point
+    any_edge(point.y(), point.y(), [&](const QPoint& a, const QPoint& b) {
+        if ((a.y() > point.y()) != (b.y() > point.y())) {
+            double cross_x = a.x() + double(point.y() - a.y()) * (b.x() - a.x()) / (b.y() - a.y());
+            if (point.x() < cross_x) inside = !inside;
+        }
+        return false;
+    });
+    return inside;
+}
+
 // ShapesContainer implementation
 void ShapesContainer::add(Shape* shape) {
+    by_id.push_back(nullptr);
+    attach(shape, ShapeId(by_id.size() - 1));
+}
+
+void ShapesContainer::attach(Shape* shape, ShapeId id) {
+    shape->slot = shapes.size();
+    shape->id = id;
     shapes.push_back(shape);
+    by_id[id] = shape;
+    xs.push_back(shape->x);
+    ys.push_back(shape->y);
+    widths.push_back(shape->width);
+    heights.push_back(shape->height);
+    kinds.push_back(shape->get_kind());
+    selection.push_back(shape->is_selected);
+    shape->owner = this;
+    grid.insert(shape, bounds_of(shape->slot));
+    ++selection_generation;
+}
+
+Shape* ShapesContainer::create(ShapeKind kind, int x, int y, const QSize& bounds) {
+    Shape* shape = pool.create(kind, x, y);
+    if (shape) {
+        shape->pooled = true;
+        if (bounds.isValid()) shape->adjust_to_bounds(bounds.width(), bounds.height());
+        add(shape);
+    }
+    return shape;
+}
+
+Shape* ShapesContainer::create(const ShapeRecord& record) {
+    Shape* shape = pool.create(ShapeKind(record.kind), record.x, record.y);
+    if (shape) {
+        shape->pooled = true;
+        record.apply_to(shape);
+        add(shape);
+    }
+    return shape;
+}
+
+void ShapesContainer::restore(const std::vector<ShapeId>& ids, const std::vector<ShapeRecord>& records,
+    const std::vector<quint32>& positions, std::vector<Shape*>& restored) {
+    std::vector<quint32> targets;
+    size_t first = restored.size();
+    for (size_t i = 0; i < ids.size(); ++i) {
+        if (ids[i] >= by_id.size() || by_id[ids[i]]) continue;
+        Shape* shape = pool.create(ShapeKind(records[i].kind), records[i].x, records[i].y);
+        if (!shape) continue;
+        shape->pooled = true;
+        shape->id = ids[i];
+        records[i].apply_to(shape);
+        restored.push_back(shape);
+        targets.push_back(positions[i]);
+    }
+    size_t count = restored.size() - first;
+    if (count == 0) return;
+
+    // Merge from the back: the shapes behind each target slot move up by the
+    // number of restored shapes still to place, each one at most once
+    size_t old_size = shapes.size();
+    size_t src = old_size;
+    size_t dst = old_size + count;
+    shapes.resize(dst);
+    xs.resize(dst);
+    ys.resize(dst);
+    widths.resize(dst);
+    heights.resize(dst);
+    kinds.resize(dst);
+    selection.resize(dst);
+    for (size_t j = count; j-- > 0;) {
+        while (src > 0 && dst - 1 > targets[j]) {
+            move_slot(--src, --dst);
+        }
+        --dst;
+        Shape* shape = restored[first + j];
+        shapes[dst] = shape;
+        shape->slot = dst;
+        xs[dst] = shape->x;
+        ys[dst] = shape->y;
+        widths[dst] = shape->width;
+        heights[dst] = shape->height;
+        kinds[dst] = shape->get_kind();
+        selection.set(dst, shape->is_selected);
+    }
+
+    for (size_t j = first; j < restored.size(); ++j) {
+        Shape* shape = restored[j];
+        by_id[shape->id] = shape;
+        shape->owner = this;
+        grid.insert(shape, bounds_of(shape->slot));
+    }
+    ++selection_generation;
+}
+
+void ShapesContainer::destroy(Shape* shape) {
+    by_id[shape->id] = nullptr;
+    ++selection_generation;
+    if (shape->pooled) {
+        pool.destroy(shape);
+    }
+    else {
+        delete shape; // Освобождаем память
+    }
+}
+
+void ShapesContainer::move_slot(size_t from, size_t to) {
+    shapes[to] = shapes[from];
+    shapes[to]->slot = to;
+    xs[to] = xs[from];
+    ys[to] = ys[from];
+    widths[to] = widths[from];
+    heights[to] = heights[from];
+    kinds[to] = kinds[from];
+    selection.set(to, selection.test(from));
+}
+
+void ShapesContainer::pop_slot() {
+    shapes.pop_back();
+    xs.pop_back();
+    ys.pop_back();
+    widths.pop_back();
+    heights.pop_back();
+    kinds.pop_back();
+    selection.pop_back();
+}
+
+void ShapesContainer::truncate(size_t count) {
+    shapes.resize(count);
+    xs.resize(count);
+    ys.resize(count);
+    widths.resize(count);
+    heights.resize(count);
+    kinds.resize(count);
+    selection.resize(count);
+}
+
+void ShapesContainer::remove(Shape* shape) {
+    if (shape->owner != this) return;
+
+    size_t slot = shape->slot;
+    grid.remove(shape, bounds_of(slot));
+    destroy(shape);
+
+    if (slot != shapes.size() - 1) {
+        move_slot(shapes.size() - 1, slot);
+    }
+    pop_slot();
+}
+
+void ShapesContainer::remove_ordered(const std::vector<Shape*>& removed) {
+    if (removed.empty()) return;
+
+    // Slots before the first removed shape stay where they are
+    size_t kept = removed.front()->slot;
+    size_t next = 0;
+    for (size_t i = kept; i < shapes.size(); ++i) {
+        if (next < removed.size() && removed[next] == shapes[i]) {
+            grid.remove(shapes[i], bounds_of(i));
+            destroy(shapes[i]);
+            ++next;
+            continue;
+        }
+        move_slot(i, kept);
+        ++kept;
+    }
+    truncate(kept);
+}
+
+QRect ShapesContainer::bounds_of(size_t slot) const {
+    return QRect(xs[slot] - Shape::BOUNDS_MARGIN, ys[slot] - Shape::BOUNDS_MARGIN,
+        widths[slot] + 2 * Shape::BOUNDS_MARGIN + 1, heights[slot] + 2 * Shape::BOUNDS_MARGIN + 1);
+}
+
+void ShapesContainer::set_geometry(size_t slot, int x, int y, int w, int h) {
+    QRect old_bounds = bounds_of(slot);
+    xs[slot] = x;
+    ys[slot] = y;
+    widths[slot] = w;
+    heights[slot] = h;
+    grid.update(shapes[slot], old_bounds, bounds_of(slot));
+}
+
+void ShapesContainer::shapes_at(const QPoint& point, std::vector<Shape*>& out) const {
+    query_buffer.clear();
+    grid.query(point, query_buffer);
+    for (Shape* shape : query_buffer) {
+        if (shape->contains(point)) {
+            out.push_back(shape);
+        }
+    }
+}
+
+void ShapesContainer::shapes_in(const QRect& rect, std::vector<Shape*>& out) const {
+    // A rect spanning as many cells as are occupied covers most of the drawing;
+    // scanning the bounds arrays beats sorting every bucket it touches
+    if (SpatialGrid::cells_spanned(rect) >= qint64(grid.cell_count())) {
+        for (size_t slot = 0; slot < shapes.size(); ++slot) {
+            if (bounds_of(slot).intersects(rect)) {
+                out.push_back(shapes[slot]);
+            }
+        }
+        return;
+    }
+
+    query_buffer.clear();
+    grid.query(rect, query_buffer);
+
+    // Drop duplicates from multi-cell shapes and restore drawing order
+    std::sort(query_buffer.begin(), query_buffer.end(),
+        [](const Shape* a, const Shape* b) { return a->slot < b->slot; });
+    query_buffer.erase(std::unique(query_buffer.begin(), query_buffer.end()), query_buffer.end());
+
+    for (Shape* shape : query_buffer) {
+        if (bounds_of(shape->slot).intersects(rect)) {
+            out.push_back(shape);
+        }
+    }
+}
+
+// Exact shape geometry, shared by contains(), the hit-test kernels and region selection
+static const int LINE_TOLERANCE = 5;
+
+static qint64 cross(const QPoint& o, const QPoint& a, const QPoint& b) {
+    return qint64(a.x() - o.x()) * (b.y() - o.y()) - qint64(a.y() - o.y()) * (b.x() - o.x());
+}
+
+static bool box_contains(int x, int y, int w, int h, const QPoint& p) {
+    return p.x() >= x && p.x() <= x + w && p.y() >= y && p.y() <= y + h;
+}
+
+static void triangle_vertices(int x, int y, int w, int h, QPoint* vertices) {
+    // Same vertices as Triangle::draw
+    vertices[0] = QPoint(x + w / 2, y);
+    vertices[1] = QPoint(x, y + h);
+    vertices[2] = QPoint(x + w, y + h);
+}
+
+static bool triangle_contains(int x, int y, int w, int h, const QPoint& p) {
+    // The box test also keeps degenerate triangles from containing whole lines
+    if (!box_contains(x, y, w, h, p)) return false;
+    QPoint v[3];
+    triangle_vertices(x, y, w, h, v);
+    qint64 d0 = cross(v[0], v[1], p), d1 = cross(v[1], v[2], p), d2 = cross(v[2], v[0], p);
+    bool negative = d0 < 0 || d1 < 0 || d2 < 0;
+    bool positive = d0 > 0 || d1 > 0 || d2 > 0;
+    return !(negative && positive);
+}
+
+static double segment_distance2(double px, double py, double ax, double ay, double bx, double by) {
+    double abx = bx - ax, aby = by - ay;
+    double apx = px - ax, apy = py - ay;
+    double length2 = abx * abx + aby * aby;
+    double t = length2 > 0 ? std::max(0.0, std::min(1.0, (apx * abx + apy * aby) / length2)) : 0.0;
+    double dx = apx - t * abx, dy = apy - t * aby;
+    return dx * dx + dy * dy;
+}
+
+static double segment_distance2(const QPoint& p, const QPoint& a, const QPoint& b) {
+    return segment_distance2(p.x(), p.y(), a.x(), a.y(), b.x(), b.y());
+}
+
+static bool line_contains(int x, int y, int w, int h, const QPoint& p) {
+    return segment_distance2(p, QPoint(x, y), QPoint(x + w, y + h)) <= LINE_TOLERANCE * LINE_TOLERANCE;
+}
+
+static bool segments_intersect(const QPoint& a, const QPoint& b, const QPoint& c, const QPoint& d) {
+    qint64 d1 = cross(c, d, a), d2 = cross(c, d, b);
+    qint64 d3 = cross(a, b, c), d4 = cross(a, b, d);
+    if (((d1 > 0 && d2 < 0) || (d1 < 0 && d2 > 0)) && ((d3 > 0 && d4 < 0) || (d3 < 0 && d4 > 0))) {
+        return true;
+    }
+    // Touching or collinear: a zero cross product plus a point inside the other segment's box
+    auto within = [](const QPoint& p, const QPoint& q, const QPoint& r) {
+        return std::min(p.x(), q.x()) <= r.x() && r.x() <= std::max(p.x(), q.x()) &&
+            std::min(p.y(), q.y()) <= r.y() && r.y() <= std::max(p.y(), q.y());
+    };
+    return (d1 == 0 && within(c, d, a)) || (d2 == 0 && within(c, d, b)) ||
+        (d3 == 0 && within(a, b, c)) || (d4 == 0 && within(a, b, d));
+}
+
+// Does segment ab touch the shape: its filled interior, or the tolerance band of a Line?
+static bool segment_touches_shape(ShapeKind kind, int x, int y, int w, int h, const QPoint& a, const QPoint& b) {
+    switch (kind) {
+    case ShapeKind::Circle: {
+        // Integer centre and radius, as in contains()
+        double radius = w / 2;
+        return segment_distance2(QPoint(x + w / 2, y + h / 2), a, b) <= radius * radius;
+    }
+    case ShapeKind::Ellipse: {
+        // Scaled so the ellipse becomes the unit circle
+        double cx = x + w / 2, cy = y + h / 2;
+        double rx = w / 2.0, ry = h / 2.0;
+        return segment_distance2(0.0, 0.0, (a.x() - cx) / rx, (a.y() - cy) / ry,
+            (b.x() - cx) / rx, (b.y() - cy) / ry) <= 1.0;
+    }
+    case ShapeKind::Rectangle:
+    case ShapeKind::Square: {
+        if (box_contains(x, y, w, h, a)) return true;
+        QPoint corners[4] = { QPoint(x, y), QPoint(x + w, y), QPoint(x + w, y + h), QPoint(x, y + h) };
+        for (int i = 0; i < 4; ++i) {
+            if (segments_intersect(a, b, corners[i], corners[(i + 1) % 4])) return true;
+        }
+        return false;
+    }
+    case ShapeKind::Triangle: {
+        if (triangle_contains(x, y, w, h, a)) return true;
+        QPoint v[3];
+        triangle_vertices(x, y, w, h, v);
+        for (int i = 0; i < 3; ++i) {
+            if (segments_intersect(a, b, v[i], v[(i + 1) % 3])) return true;
+        }
+        return false;
+    }
+    case ShapeKind::Line: {
+        QPoint start(x, y), end(x + w, y + h);
+        if (segments_intersect(a, b, start, end)) return true;
+        // Otherwise the closest pair of points includes an endpoint
+        double limit = LINE_TOLERANCE * LINE_TOLERANCE;
+        return segment_distance2(a, start, end) <= limit || segment_distance2(b, start, end) <= limit ||
+            segment_distance2(start, a, b) <= limit || segment_distance2(end, a, b) <= limit;
+    }
+    default:
+        return false;
+    }
+}
+
+// Area the shape's geometry can reach, tighter than the margin-padded bounds
+static QRect shape_extent(ShapeKind kind, int x, int y, int w, int h) {
+    int pad = kind == ShapeKind::Line ? LINE_TOLERANCE : 0;
+    return QRect(QPoint(x - pad, y - pad), QPoint(x + w + pad, y + h + pad));
+}
+
+// A point that belongs to the shape
+static QPoint shape_anchor(ShapeKind kind, int x, int y, int w, int h) {
+    switch (kind) {
+    case ShapeKind::Circle:
+    case ShapeKind::Ellipse: return QPoint(x + w / 2, y + h / 2);
+    case ShapeKind::Triangle: return QPoint(x + w / 2, y);
+    default: return QPoint(x, y);
+    }
+}
+
+// A connected shape touches a region if it lies inside it or meets its boundary
+static bool shape_touches_rect(ShapeKind kind, int x, int y, int w, int h, const QRect& rect) {
+    QRect extent = shape_extent(kind, x, y, w, h);
+    if (!extent.intersects(rect)) return false;
+    if (rect.contains(extent) || rect.contains(shape_anchor(kind, x, y, w, h))) return true;
+
+    QPoint corners[4] = { rect.topLeft(), rect.topRight(), rect.bottomRight(), rect.bottomLeft() };
+    for (int i = 0; i < 4; ++i) {
+        if (segment_touches_shape(kind, x, y, w, h, corners[i], corners[(i + 1) % 4])) return true;
+    }
+    return false;
+}
+
+static bool shape_touches_lasso(ShapeKind kind, int x, int y, int w, int h, const LassoRegion& lasso) {
+    QRect extent = shape_extent(kind, x, y, w, h);
+    if (!extent.intersects(lasso.bounds())) return false;
+    if (lasso.contains(shape_anchor(kind, x, y, w, h))) return true;
+
+    return lasso.any_edge(extent.top(), extent.bottom(), [&](const QPoint& a, const QPoint& b) {
+        if (std::max(a.x(), b.x()) < extent.left() || std::min(a.x(), b.x()) > extent.right() ||
+            std::max(a.y(), b.y()) < extent.top() || std::min(a.y(), b.y()) > extent.bottom()) {
+            return false;
+        }
+        return segment_touches_shape(kind, x, y, w, h, a, b);
+    });
+}
+
+// Batched hit-test kernels
+// Each kernel mirrors the scalar contains() of the shape classes exactly,
+// including integer centre rounding and the double math of Ellipse.
+struct HitTestArrays {
+    const int* xs;
+    const int* ys;
+    const int* ws;
+    const int* hs;
+    const quint8* kinds;
+    size_t count;
+};
+
+using HitTestKernel = void (*)(const HitTestArrays& arrays, int px, int py, quint64* mask);
+
+static bool contains_scalar(ShapeKind kind, int x, int y, int w, int h, int px, int py) {
+    switch (kind) {
+    case ShapeKind::Circle: {
+        int dx = px - (x + w / 2);
+        int dy = py - (y + h / 2);
+        int radius = w / 2;
+        return (dx * dx + dy * dy) <= (radius * radius);
+    }
+    case ShapeKind::Ellipse: {
+        double dx = (px - (x + w / 2)) / (w / 2.0);
+        double dy = (py - (y + h / 2)) / (h / 2.0);
+        return (dx * dx + dy * dy) <= 1.0;
+    }
+    case ShapeKind::Rectangle:
+    case ShapeKind::Square:
+        return box_contains(x, y, w, h, QPoint(px, py));
+    case ShapeKind::Triangle:
+        return triangle_contains(x, y, w, h, QPoint(px, py));
+    case ShapeKind::Line:
+        return line_contains(x, y, w, h, QPoint(px, py));
+    default:
+        return false;
+    }
+}
+
+static void hit_test_range(const HitTestArrays& a, size_t first, int px, int py, quint64* mask) {
+    for (size_t i = first; i < a.count; ++i) {
+        if (contains_scalar(ShapeKind(a.kinds[i]), a.xs[i], a.ys[i], a.ws[i], a.hs[i], px, py)) {
+            mask[i >> 6] |= quint64(1) << (i & 63);
+        }
+    }
+}
+
+static void hit_test_scalar(const HitTestArrays& arrays, int px, int py, quint64* mask) {
+    hit_test_range(arrays, 0, px, py, mask);
+}
+
+#ifdef SHAPE_HIT_TEST_X86
+// Bits of the lanes holding a shape of the given kind
+static unsigned kind_bits(const quint8* kinds, int lanes, ShapeKind kind) {
+    unsigned bits = 0;
+    for (int lane = 0; lane < lanes; ++lane) {
+        if (kinds[lane] == quint8(kind)) bits |= 1u << lane;
+    }
+    return bits;
+}
+
+// The vector code only box-tests triangles and lines; lanes that pass get the exact test
+static unsigned refine_exact(const HitTestArrays& a, size_t first, int lanes, unsigned hits, int px, int py) {
+    unsigned candidates = hits & (kind_bits(a.kinds + first, lanes, ShapeKind::Triangle) |
+        kind_bits(a.kinds + first, lanes, ShapeKind::Line));
+    for (; candidates; candidates &= candidates - 1) {
+        int lane = lowest_set_bit(candidates);
+        size_t i = first + size_t(lane);
+        if (!contains_scalar(ShapeKind(a.kinds[i]), a.xs[i], a.ys[i], a.ws[i], a.hs[i], px, py)) {
+            hits &= ~(1u << lane);
+        }
+    }
+    return hits;
+}
+
+static unsigned select_by_kind(const quint8* kinds, int lanes,
+    unsigned box, unsigned line, unsigned circle, unsigned ellipse) {
+    return (box & (kind_bits(kinds, lanes, ShapeKind::Rectangle) |
+                   kind_bits(kinds, lanes, ShapeKind::Square) |
+                   kind_bits(kinds, lanes, ShapeKind::Triangle))) |
+           (line & kind_bits(kinds, lanes, ShapeKind::Line)) |
+           (circle & kind_bits(kinds, lanes, ShapeKind::Circle)) |
+           (ellipse & kind_bits(kinds, lanes, ShapeKind::Ellipse));
+}
+
+static void hit_test_sse2(const HitTestArrays& a, int px, int py, quint64* mask) {
+    const __m128i p = _mm_set1_epi32(px);
+    const __m128i q = _mm_set1_epi32(py);
+    const __m128i margin = _mm_set1_epi32(5);
+    const __m128d one = _mm_set1_pd(1.0);
+    const __m128d half = _mm_set1_pd(0.5);
+
+    size_t i = 0;
+    for (; i + 4 <= a.count; i += 4) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a.xs + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a.ys + i));
+        __m128i w = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a.ws + i));
+        __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a.hs + i));
+        __m128i right = _mm_add_epi32(x, w);
+        __m128i bottom = _mm_add_epi32(y, h);
+
+        // Inside means !(x > p || p > right || y > q || q > bottom)
+        __m128i outside = _mm_or_si128(
+            _mm_or_si128(_mm_cmpgt_epi32(x, p), _mm_cmpgt_epi32(p, right)),
+            _mm_or_si128(_mm_cmpgt_epi32(y, q), _mm_cmpgt_epi32(q, bottom)));
+        unsigned box = ~unsigned(_mm_movemask_ps(_mm_castsi128_ps(outside))) & 0xF;
+
+        __m128i outside_line = _mm_or_si128(
+            _mm_or_si128(_mm_cmpgt_epi32(_mm_sub_epi32(x, margin), p),
+                _mm_cmpgt_epi32(p, _mm_add_epi32(right, margin))),
+            _mm_or_si128(_mm_cmpgt_epi32(_mm_sub_epi32(y, margin), q),
+                _mm_cmpgt_epi32(q, _mm_add_epi32(bottom, margin))));
+        unsigned line = ~unsigned(_mm_movemask_ps(_mm_castsi128_ps(outside_line))) & 0xF;
+
+        // SSE2 has no 32-bit multiply, so Circle and Ellipse use double lanes,
+        // two shapes at a time (exact for any coordinates the int version handles)
+        __m128i half_w = _mm_srai_epi32(w, 1);
+        __m128i half_h = _mm_srai_epi32(h, 1);
+        __m128i dx = _mm_sub_epi32(p, _mm_add_epi32(x, half_w));
+        __m128i dy = _mm_sub_epi32(q, _mm_add_epi32(y, half_h));
+        unsigned circle = 0, ellipse = 0;
+        for (int part = 0; part < 2; ++part) {
+            __m128d dxd = _mm_cvtepi32_pd(dx);
+            __m128d dyd = _mm_cvtepi32_pd(dy);
+            __m128d rd = _mm_cvtepi32_pd(half_w);
+
+            __m128d d2 = _mm_add_pd(_mm_mul_pd(dxd, dxd), _mm_mul_pd(dyd, dyd));
+            circle |= unsigned(_mm_movemask_pd(_mm_cmple_pd(d2, _mm_mul_pd(rd, rd)))) << (2 * part);
+
+            __m128d ex = _mm_div_pd(dxd, _mm_mul_pd(_mm_cvtepi32_pd(w), half));
+            __m128d ey = _mm_div_pd(dyd, _mm_mul_pd(_mm_cvtepi32_pd(h), half));
+            __m128d e2 = _mm_add_pd(_mm_mul_pd(ex, ex), _mm_mul_pd(ey, ey));
+            ellipse |= unsigned(_mm_movemask_pd(_mm_cmple_pd(e2, one))) << (2 * part);
+
+            // Move the upper two lanes down for the second half
+            dx = _mm_shuffle_epi32(dx, 0x4E);
+            dy = _mm_shuffle_epi32(dy, 0x4E);
+            half_w = _mm_shuffle_epi32(half_w, 0x4E);
+            w = _mm_shuffle_epi32(w, 0x4E);
+            h = _mm_shuffle_epi32(h, 0x4E);
+        }
+
+        unsigned hits = refine_exact(a, i, 4, select_by_kind(a.kinds + i, 4, box, line, circle, ellipse), px, py);
+        mask[i >> 6] |= quint64(hits) << (i & 63);
+    }
+    hit_test_range(a, i, px, py, mask);
+}
+
+SHAPE_TARGET_AVX2
+static void hit_test_avx2(const HitTestArrays& a, int px, int py, quint64* mask) {
+    const __m256i p = _mm256_set1_epi32(px);
+    const __m256i q = _mm256_set1_epi32(py);
+    const __m256i margin = _mm256_set1_epi32(5);
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d half = _mm256_set1_pd(0.5);
+
+    size_t i = 0;
+    for (; i + 8 <= a.count; i += 8) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a.xs + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a.ys + i));
+        __m256i w = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a.ws + i));
+        __m256i h = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a.hs + i));
+        __m256i right = _mm256_add_epi32(x, w);
+        __m256i bottom = _mm256_add_epi32(y, h);
+
+        __m256i outside = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpgt_epi32(x, p), _mm256_cmpgt_epi32(p, right)),
+            _mm256_or_si256(_mm256_cmpgt_epi32(y, q), _mm256_cmpgt_epi32(q, bottom)));
+        unsigned box = ~unsigned(_mm256_movemask_ps(_mm256_castsi256_ps(outside))) & 0xFF;
+
+        __m256i outside_line = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpgt_epi32(_mm256_sub_epi32(x, margin), p),
+                _mm256_cmpgt_epi32(p, _mm256_add_epi32(right, margin))),
+            _mm256_or_si256(_mm256_cmpgt_epi32(_mm256_sub_epi32(y, margin), q),
+                _mm256_cmpgt_epi32(q, _mm256_add_epi32(bottom, margin))));
+        unsigned line = ~unsigned(_mm256_movemask_ps(_mm256_castsi256_ps(outside_line))) & 0xFF;
+
+        // Circle stays in int32 lanes, same as the scalar code
+        __m256i half_w = _mm256_srai_epi32(w, 1);
+        __m256i half_h = _mm256_srai_epi32(h, 1);
+        __m256i dx = _mm256_sub_epi32(p, _mm256_add_epi32(x, half_w));
+        __m256i dy = _mm256_sub_epi32(q, _mm256_add_epi32(y, half_h));
+        __m256i d2 = _mm256_add_epi32(_mm256_mullo_epi32(dx, dx), _mm256_mullo_epi32(dy, dy));
+        __m256i r2 = _mm256_mullo_epi32(half_w, half_w);
+        unsigned circle = ~unsigned(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(d2, r2)))) & 0xFF;
+
+        // Ellipse in double lanes, four shapes at a time
+        unsigned ellipse = 0;
+        for (int part = 0; part < 2; ++part) {
+            __m128i dx4 = part ? _mm256_extracti128_si256(dx, 1) : _mm256_castsi256_si128(dx);
+            __m128i dy4 = part ? _mm256_extracti128_si256(dy, 1) : _mm256_castsi256_si128(dy);
+            __m128i w4 = part ? _mm256_extracti128_si256(w, 1) : _mm256_castsi256_si128(w);
+            __m128i h4 = part ? _mm256_extracti128_si256(h, 1) : _mm256_castsi256_si128(h);
+
+            __m256d ex = _mm256_div_pd(_mm256_cvtepi32_pd(dx4), _mm256_mul_pd(_mm256_cvtepi32_pd(w4), half));
+            __m256d ey = _mm256_div_pd(_mm256_cvtepi32_pd(dy4), _mm256_mul_pd(_mm256_cvtepi32_pd(h4), half));
+            __m256d e2 = _mm256_add_pd(_mm256_mul_pd(ex, ex), _mm256_mul_pd(ey, ey));
+            ellipse |= unsigned(_mm256_movemask_pd(_mm256_cmp_pd(e2, one, _CMP_LE_OQ))) << (4 * part);
+        }
+
+        unsigned hits = refine_exact(a, i, 8, select_by_kind(a.kinds + i, 8, box, line, circle, ellipse), px, py);
+        mask[i >> 6] |= quint64(hits) << (i & 63);
+    }
+    hit_test_range(a, i, px, py, mask);
+}
+
+static bool cpu_has_avx2() {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_cpu_supports("avx2");
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+    __cpuidex(info, 7, 0);
+    return os_saves_ymm && (info[1] & (1 << 5));
+#else
+    return false;
+#endif
+}
+#endif
+
+static HitTestKernel hit_test_kernel_for(HitTestIsa isa) {
+    switch (isa) {
+    case HitTestIsa::Scalar:
+        return hit_test_scalar;
+#ifdef SHAPE_HIT_TEST_X86
+    case HitTestIsa::Sse2:
+        return hit_test_sse2;
+    case HitTestIsa::Avx2:
+        return cpu_has_avx2() ? hit_test_avx2 : nullptr;
+    case HitTestIsa::Auto:
+        return cpu_has_avx2() ? hit_test_avx2 : hit_test_sse2;
+#else
+    case HitTestIsa::Auto:
+        return hit_test_scalar;
+#endif
+    default:
+        return nullptr;
+    }
+}
+
+static HitTestKernel hit_test_kernel = hit_test_kernel_for(HitTestIsa::Auto);
+
+bool ShapesContainer::use_hit_test_isa(HitTestIsa isa) {
+    HitTestKernel kernel = hit_test_kernel_for(isa);
+    if (!kernel) return false;
+    hit_test_kernel = kernel;
+    return true;
+}
+
+void ShapesContainer::hit_test(const QPoint& point, std::vector<quint64>& mask) const {
+    mask.assign((shapes.size() + 63) / 64, 0);
+    HitTestArrays arrays = { xs.data(), ys.data(), widths.data(), heights.data(),
+        reinterpret_cast<const quint8*>(kinds.data()), shapes.size() };
+    hit_test_kernel(arrays, point.x(), point.y(), mask.data());
+}
+
+void ShapesContainer::hit_test(const std::vector<QPoint>& points, std::vector<quint64>& mask) const {
+    mask.assign((shapes.size() + 63) / 64, 0);
+    HitTestArrays arrays = { xs.data(), ys.data(), widths.data(), heights.data(),
+        reinterpret_cast<const quint8*>(kinds.data()), shapes.size() };
+    for (const QPoint& point : points) {
+        hit_test_kernel(arrays, point.x(), point.y(), mask.data());
+    }
+}
+
+template<class Test>
+void ShapesContainer::region_hit_test(const QRect& area, std::vector<quint64>& mask, Test touches) const {
+    mask.assign((shapes.size() + 63) / 64, 0);
+    auto test = [&](size_t slot) {
+        quint64 bit = quint64(1) << (slot & 63);
+        if (!(mask[slot >> 6] & bit) && touches(kinds[slot], xs[slot], ys[slot], widths[slot], heights[slot])) {
+            mask[slot >> 6] |= bit;
+        }
+    };
+
+    // Grid duplicates are skipped by the mask check instead of sorting
+    if (SpatialGrid::cells_spanned(area) > qint64(grid.cell_count())) {
+        for (size_t slot = 0; slot < shapes.size(); ++slot) test(slot);
+        return;
+    }
+    query_buffer.clear();
+    grid.query(area, query_buffer);
+    for (const Shape* shape : query_buffer) test(shape->slot);
+}
+
+void ShapesContainer::region_hit_test(const QRect& rect, std::vector<quint64>& mask) const {
+    region_hit_test(rect, mask, [&](ShapeKind kind, int x, int y, int w, int h) {
+        return shape_touches_rect(kind, x, y, w, h, rect);
+    });
+}
+
+void ShapesContainer::region_hit_test(const LassoRegion& lasso, std::vector<quint64>& mask) const {
+    region_hit_test(lasso.bounds(), mask, [&](ShapeKind kind, int x, int y, int w, int h) {
+        return shape_touches_lasso(kind, x, y, w, h, lasso);
+    });
+}
+
+void ShapesContainer::clear() {
+    for (Shape* shape : shapes) {
+        by_id[shape->id] = nullptr;
+        if (shape->pooled) shape->~Shape();
+        else delete shape;
+    }
+    pool.clear();
+    grid.clear();
+    shapes.clear();
+    xs.clear();
+    ys.clear();
+    widths.clear();
+    heights.clear();
+    kinds.clear();
+    selection.clear();
+    ++selection_generation;
+}
+
+void ShapesContainer::reserve(size_t count) {
+    shapes.reserve(count);
+    by_id.reserve(by_id.size() + count);
+    xs.reserve(count);
+    ys.reserve(count);
+    widths.reserve(count);
+    heights.reserve(count);
+    kinds.reserve(count);
+    selection.reserve(count);
+}
+
+void ShapesContainer::clear_selected(EditCommand* changes) {
+    size_t selected_count = selection.count();
+    if (selected_count == 0) return;
+
+    log_event(LogLevel::Info, LogEvent::SelectionDeleted, ShapeKind::Unknown, int(selected_count));
+    if (changes) {
+        selection.for_each_set([&](size_t i) {
+            changes->ids.push_back(shapes[i]->id);
+            changes->records.push_back(ShapeRecord::of(shapes[i]));
+            changes->positions.push_back(quint32(i));
+        });
+    }
+
+    // Whole drawing selected: drop every slab and the grid at once
+    if (selected_count == shapes.size()) {
+        clear();
+        return;
+    }
+
+    // Large selections: rebuilding the grid from the survivors beats
+    // removing every deleted shape from its cells
+    bool rebuild_grid = selected_count > shapes.size() / 2;
+
+    // Освобождаем память удаляемых фигур и сдвигаем оставшиеся в одном проходе;
+    // slots before the first selected one stay where they are
+    size_t kept = selection.next_set(0);
+    for (size_t i = kept; i < shapes.size(); ++i) {
+        if (selection.test(i)) {
+            if (!rebuild_grid) grid.remove(shapes[i], bounds_of(i));
+            destroy(shapes[i]);
+            continue;
+        }
+        move_slot(i, kept);
+        ++kept;
+    }
+    truncate(kept);
+
+    if (rebuild_grid) {
+        grid.clear();
+        for (size_t i = 0; i < kept; ++i) {
+            grid.insert(shapes[i], bounds_of(i));
+        }
+    }
+}
+
+// Runs body over [0, count) in chunks spread across pool; small ranges, or
+// no pool, stay on the calling thread
+static void for_chunks(WorkerPool* pool, size_t count, const std::function<void(size_t, size_t)>& body) {
+    const size_t CHUNK = 16384;
+    if (!pool || count <= CHUNK) {
+        body(0, count);
+        return;
+    }
+    size_t chunk_count = (count + CHUNK - 1) / CHUNK;
+    pool->parallel_for(chunk_count, [&](size_t chunk) {
+        body(chunk * CHUNK, std::min(count, (chunk + 1) * CHUNK));
+    });
+}
+
+void ShapesContainer::collect_selected_slots() {
+    selected_slots.clear();
+    selected_slots.reserve(selection.count());
+    selection.for_each_set([this](size_t slot) { selected_slots.push_back(slot); });
+}
+
+void ShapesContainer::update_grid_for_selected(int dx, int dy, int dw, int dh, WorkerPool* pool) {
+    // Shapes that change cells are counted in parallel; most small moves have none
+    const size_t* indices = selected_slots.data();
+    std::atomic<size_t> crossing(0);
+    for_chunks(pool, selected_slots.size(), [&](size_t first, size_t last) {
+        size_t count = 0;
+        for (size_t i = first; i < last; ++i) {
+            QRect new_bounds = bounds_of(indices[i]);
+            count += !SpatialGrid::same_cells(new_bounds.adjusted(-dx, -dy, -dx - dw, -dy - dh), new_bounds);
+        }
+        crossing.fetch_add(count, std::memory_order_relaxed);
+    });
+    if (crossing.load() == 0) return;
+
+    // Most of the drawing changes cells: rebuilding beats taking each shape out
+    // of its old cells
+    if (crossing.load() > shapes.size() / 2) {
+        grid.clear();
+        for (size_t i = 0; i < shapes.size(); ++i) {
+            grid.insert(shapes[i], bounds_of(i));
+        }
+        return;
+    }
+
+    // The grid is shared, so cell updates stay on this thread
+    for (size_t slot : selected_slots) {
+        QRect new_bounds = bounds_of(slot);
+        grid.update(shapes[slot], new_bounds.adjusted(-dx, -dy, -dx - dw, -dy - dh), new_bounds);
+    }
+}
+
+bool ShapesContainer::translate_selected(int dx, int dy, int canvas_width, int canvas_height, WorkerPool* pool) {
+    collect_selected_slots();
+    if (selected_slots.empty()) return false;
+
+    const size_t* indices = selected_slots.data();
+    std::atomic<bool> fits(true);
+    for_chunks(pool, selected_slots.size(), [&](size_t first, size_t last) {
+        bool chunk_fits = true;
+        for (size_t i = first; i < last; ++i) {
+            size_t slot = indices[i];
+            int new_x = xs[slot] + dx, new_y = ys[slot] + dy;
+            chunk_fits &= new_x >= 0 && new_x <= canvas_width - widths[slot] &&
+                new_y >= 0 && new_y <= canvas_height - heights[slot];
+        }
+        if (!chunk_fits) fits.store(false, std::memory_order_relaxed);
+    });
+    if (!fits.load()) {
+        log_event(LogLevel::Warning, LogEvent::SelectionBlocked, ShapeKind::Unknown,
+            int(selected_slots.size()), dx, dy);
+        return false;
+    }
+
+    for_chunks(pool, selected_slots.size(), [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            xs[indices[i]] += dx;
+            ys[indices[i]] += dy;
+        }
+    });
+    update_grid_for_selected(dx, dy, 0, 0, pool);
+    log_event(LogLevel::Info, LogEvent::SelectionMoved, ShapeKind::Unknown, int(selected_slots.size()), dx, dy);
+    return true;
+}
+
+bool ShapesContainer::resize_selected(int dw, int dh, int canvas_width, int canvas_height, WorkerPool* pool) {
+    collect_selected_slots();
+    if (selected_slots.empty()) return false;
+
+    const size_t* indices = selected_slots.data();
+    std::atomic<bool> fits(true);
+    for_chunks(pool, selected_slots.size(), [&](size_t first, size_t last) {
+        bool chunk_fits = true;
+        for (size_t i = first; i < last; ++i) {
+            size_t slot = indices[i];
+            int new_width = widths[slot] + dw, new_height = heights[slot] + dh;
+            chunk_fits &= new_width > 0 && new_height > 0 &&
+                xs[slot] + new_width <= canvas_width && ys[slot] + new_height <= canvas_height;
+        }
+        if (!chunk_fits) fits.store(false, std::memory_order_relaxed);
+    });
+    if (!fits.load()) {
+        log_event(LogLevel::Warning, LogEvent::SelectionBlocked, ShapeKind::Unknown,
+            int(selected_slots.size()), dw, dh);
+        return false;
+    }
+
+    for_chunks(pool, selected_slots.size(), [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            widths[indices[i]] += dw;
+            heights[indices[i]] += dh;
+        }
+    });
+    update_grid_for_selected(0, 0, dw, dh, pool);
+    log_event(LogLevel::Info, LogEvent::SelectionResized, ShapeKind::Unknown, int(selected_slots.size()), dw, dh);
+    return true;
+}
+
+void ShapesContainer::recolor_selected(const QColor& color, WorkerPool* pool) {
+    collect_selected_slots();
+    if (selected_slots.empty()) return;
+
+    // Colors live in the shapes themselves; each job writes distinct objects
+    const size_t* indices = selected_slots.data();
+    for_chunks(pool, selected_slots.size(), [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            shapes[indices[i]]->set_color(color);
+        }
+    });
+    log_event(LogLevel::Info, LogEvent::SelectionRecolored, ShapeKind::Unknown,
+        int(color.rgba()), int(selected_slots.size()));
+}
+
+void ShapesContainer::adjust_to_bounds(int canvas_width, int canvas_height, EditCommand* changes) {
+    // Only the geometry arrays are streamed; shapes that need no change are never touched
+    size_t adjusted = 0;
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        int new_x = std::max(0, std::min(xs[i], canvas_width - widths[i]));
+        int new_y = std::max(0, std::min(ys[i], canvas_height - heights[i]));
+        if (new_x == xs[i] && new_y == ys[i]) continue;
+
+        if (changes) {
+            changes->ids.push_back(shapes[i]->id);
+            changes->offsets.push_back(QPoint(new_x - xs[i], new_y - ys[i]));
+        }
+        set_geometry(i, new_x, new_y, widths[i], heights[i]);
+        ++adjusted;
+    }
+    if (adjusted > 0) {
+        log_event(LogLevel::Info, LogEvent::ShapesAdjusted, ShapeKind::Unknown,
+            int(adjusted), canvas_width, canvas_height);
+    }
+}
+
+size_t ShapesContainer::size() const {
+    return shapes.size();
+}
+
+ShapesContainer::~ShapesContainer() {
+    clear();
+}
+
+// Shape implementation
+Shape::Shape(int x, int y, ShapeKind kind) : x(x), y(y), width(50), height(50), is_selected(false),
+color(0, 0, 255), selection_color(255, 0, 0),
+line_width(2), selection_line_width(3), kind(kind), owner(nullptr), slot(0), id(0), pooled(false), grid_entries{} {}
+
+void Shape::set_geometry(int x, int y, int w, int h) {
+    if (owner) {
+        owner->set_geometry(slot, x, y, w, h);
+        return;
+    }
+    this->x = x;
+    this->y = y;
+    width = w;
+    height = h;
+}
+
+QRect Shape::get_bounds() const {
+    return QRect(get_x() - BOUNDS_MARGIN, get_y() - BOUNDS_MARGIN,
+        get_width() + 2 * BOUNDS_MARGIN + 1, get_height() + 2 * BOUNDS_MARGIN + 1);
+}
+
+bool Shape::move(int dx, int dy, int canvas_width, int canvas_height) {
+    int old_x = get_x(), old_y = get_y();
+    int new_x = old_x + dx;
+    int new_y = old_y + dy;
+
+    if (new_x >= 0 && new_x <= canvas_width - get_width() &&
+        new_y >= 0 && new_y <= canvas_height - get_height()) {
+        set_geometry(new_x, new_y, get_width(), get_height());
+        log_event(LogLevel::Info, LogEvent::Moved, kind, old_x, old_y, new_x, new_y);
+        return true;
+    }
+    else {
+        log_event(LogLevel::Warning, LogEvent::MoveBlocked, kind);
+        return false;
+    }
+}
+
+bool Shape::resize(int dw, int dh, int canvas_width, int canvas_height) {
+    int old_width = get_width(), old_height = get_height();
+    int new_width = old_width + dw;
+    int new_height = old_height + dh;
+
+    if (new_width > 0 && new_height > 0 &&
+        get_x() + new_width <= canvas_width &&
+        get_y() + new_height <= canvas_height) {
+        set_geometry(get_x(), get_y(), new_width, new_height);
+        log_event(LogLevel::Info, LogEvent::Resized, kind, old_width, old_height, new_width, new_height);
+        return true;
+    }
+    else {
+        log_event(LogLevel::Warning, LogEvent::ResizeBlocked, kind, dw, dh);
+        return false;
+    }
+}
+
+void Shape::adjust_to_bounds(int canvas_width, int canvas_height) {
+    int old_x = get_x(), old_y = get_y();
+    int new_x = old_x, new_y = old_y;
+    bool adjusted = false;
+
+    if (new_x + get_width() > canvas_width) {
+        new_x = std::max(0, canvas_width - get_width());
+        adjusted = true;
+    }
+    if (new_y + get_height() > canvas_height) {
+        new_y = std::max(0, canvas_height - get_height());
+        adjusted = true;
+    }
+    if (new_x < 0) {
+        new_x = 0;
+        adjusted = true;
+    }
+    if (new_y < 0) {
+        new_y = 0;
+        adjusted = true;
+    }
+
+    if (adjusted) {
+        set_geometry(new_x, new_y, get_width(), get_height());
+        log_event(LogLevel::Info, LogEvent::Adjusted, kind, old_x, old_y, new_x, new_y);
+    }
+}
+
+ShapeKind Shape::kind_from_id(const QString& id) {
+    for (size_t i = 0; i < size_t(ShapeKind::Unknown); ++i) {
+        if (id == QLatin1String(shape_kind_ids[i].data(), int(shape_kind_ids[i].size()))) {
+            return ShapeKind(i);
+        }
+    }
+    return ShapeKind::Unknown;
+}
+
+// Circle implementation
+Circle::Circle(int x, int y) : Shape(x, y, ShapeKind::Circle) {
+    selection_color = QColor(255, 69, 0); // Orange
+}
+
+void Circle::draw(QPainter& painter) {
+    QPen pen(color, line_width);
+    painter.setPen(pen);
+    painter.drawEllipse(get_x(), get_y(), get_width(), get_height());
+
+    if (get_selected()) {
+        QPen selection_pen(selection_color, selection_line_width);
+        painter.setPen(selection_pen);
+        painter.setBrush(QBrush(QColor(0, 0, 0, 0)));
+        painter.drawEllipse(get_x() - 3, get_y() - 3, get_width() + 6, get_height() + 6);
+    }
+}
+
+bool Circle::contains(const QPoint& point) const {
+    int center_x = get_x() + get_width() / 2;
+    int center_y = get_y() + get_height() / 2;
+    int radius = get_width() / 2;
+    int dx = point.x() - center_x;
+    int dy = point.y() - center_y;
+    return (dx * dx + dy * dy) <= (radius * radius);
+}
+
+// Rectangle implementation
+Rectangle::Rectangle(int x, int y) : Shape(x, y, ShapeKind::Rectangle) {
+    set_width(80);
+    set_height(40);
+    selection_color = QColor(0, 255, 255); // Cyan
+}
+
+void Rectangle::draw(QPainter& painter) {
+    QPen pen(color, line_width);
+    painter.setPen(pen);
+    painter.drawRect(get_x(), get_y(), get_width(), get_height());
+
+    if (get_selected()) {
+        QPen selection_pen(selection_color, selection_line_width);
+        painter.setPen(selection_pen);
+        painter.setBrush(QBrush(QColor(0, 0, 0, 0)));
+        painter.drawRect(get_x() - 3, get_y() - 3, get_width() + 6, get_height() + 6);
+    }
+}
+
+bool Rectangle::contains(const QPoint& point) const {
+    return (point.x() >= get_x() && point.x() <= get_x() + get_width() &&
+        point.y() >= get_y() && point.y() <= get_y() + get_height());
+}
+
+// Square implementation
+Square::Square(int x, int y) : Shape(x, y, ShapeKind::Square) {
+    set_width(50);
+    set_height(50);
+    selection_color = QColor(255, 0, 255); // Magenta
+}
+
+void Square::draw(QPainter& painter) {
+    QPen pen(color, line_width);
+    painter.setPen(pen);
+    painter.drawRect(get_x(), get_y(), get_width(), get_height());
+
+    if (get_selected()) {
+        QPen selection_pen(selection_color, selection_line_width);
+        painter.setPen(selection_pen);
+        painter.setBrush(QBrush(QColor(0, 0, 0, 0)));
+        painter.drawRect(get_x() - 3, get_y() - 3, get_width() + 6, get_height() + 6);
+    }
 }
 
-void ShapesContainer::remove(Shape* shape) {
-    auto it = std::find(shapes.begin(), shapes.end(), shape);
-    if (it != shapes.end()) {
-        delete* it; // Освобождаем память
-        shapes.erase(it);
+bool Square::contains(const QPoint& point) const {
+    return (point.x() >= get_x() && point.x() <= get_x() + get_width() &&
+        point.y() >= get_y() && point.y() <= get_y() + get_height());
+}
+
+// Ellipse implementation
+Ellipse::Ellipse(int x, int y) : Shape(x, y, ShapeKind::Ellipse) {
+    set_width(70);
+    set_height(40);
+    selection_color = QColor(128, 128, 0); // Olive
+}
+
+void Ellipse::draw(QPainter& painter) {
+    QPen pen(color, line_width);
+    painter.setPen(pen);
+    painter.drawEllipse(get_x(), get_y(), get_width(), get_height());
+
+    if (get_selected()) {
+        QPen selection_pen(selection_color, selection_line_width);
+        painter.setPen(selection_pen);
+        painter.setBrush(QBrush(QColor(0, 0, 0, 0)));
+        painter.drawEllipse(get_x() - 3, get_y() - 3, get_width() + 6, get_height() + 6);
     }
 }
 
-std::vector<Shape*> ShapesContainer::get_all() const {
-    return shapes;
+bool Ellipse::contains(const QPoint& point) const {
+    int center_x = get_x() + get_width() / 2;
+    int center_y = get_y() + get_height() / 2;
+    double dx = (point.x() - center_x) / (get_width() / 2.0);
+    double dy = (point.y() - center_y) / (get_height() / 2.0);
+    return (dx * dx + dy * dy) <= 1.0;
+}
+
+// Triangle implementation
+Triangle::Triangle(int x, int y) : Shape(x, y, ShapeKind::Triangle) {
+    set_width(60);
+    set_height(60);
+    selection_color = QColor(0, 128, 128); // Teal
 }
 
-void ShapesContainer::clear_selected() {
-    std::vector<QString> selected_types;
-    for (Shape* shape : shapes) {
-        if (shape->get_selected()) {
-            selected_types.push_back(Shape::get_shape_type_name(shape));
-        }
+void Triangle::draw(QPainter& painter) {
+    QPolygon polygon;
+    polygon << QPoint(get_x() + get_width() / 2, get_y())
+        << QPoint(get_x(), get_y() + get_height())
+        << QPoint(get_x() + get_width(), get_y() + get_height());
+
+    QPen pen(color, line_width);
+    painter.setPen(pen);
+    painter.drawPolygon(polygon);
+
+    if (get_selected()) {
+        QPen selection_pen(selection_color, selection_line_width);
+        painter.setPen(selection_pen);
+        painter.setBrush(QBrush(QColor(0, 0, 0, 0)));
+        painter.drawPolygon(polygon);
     }
+}
 
-    // Освобождаем память удаляемых фигур
-    for (Shape* shape : shapes) {
-        if (shape->get_selected()) {
-            delete shape;
+bool Triangle::contains(const QPoint& point) const {
+    return triangle_contains(get_x(), get_y(), get_width(), get_height(), point);
+}
+
+// Line implementation
+Line::Line(int x, int y) : Shape(x, y, ShapeKind::Line) {
+    set_width(80);
+    set_height(2);
+    selection_color = QColor(128, 0, 128); // Purple
+    line_width = 3;
+    selection_line_width = 4;
+}
+
+void Line::draw(QPainter& painter) {
+    QPen pen(color, line_width);
+    painter.setPen(pen);
+    painter.drawLine(get_x(), get_y(), get_x() + get_width(), get_y() + get_height());
+
+    if (get_selected()) {
+        QPen selection_pen(selection_color, selection_line_width);
+        painter.setPen(selection_pen);
+        painter.drawRect(get_x() - 3, get_y() - 3, get_width() + 6, get_height() + 6);
+    }
+}
+
+bool Line::contains(const QPoint& point) const {
+    return line_contains(get_x(), get_y(), get_width(), get_height(), point);
+}
+
+// Shape factory, indexed by ShapeKind: object size plus a constructor that
+// builds the shape in caller-provided memory
+struct ShapeType {
+    size_t size;
+    Shape* (*construct)(void* memory, int x, int y);
+};
+
+static const ShapeType shape_types[] = {
+    { sizeof(Circle), [](void* memory, int x, int y) -> Shape* { return new (memory) Circle(x, y); } },
+    { sizeof(Rectangle), [](void* memory, int x, int y) -> Shape* { return new (memory) Rectangle(x, y); } },
+    { sizeof(Square), [](void* memory, int x, int y) -> Shape* { return new (memory) Square(x, y); } },
+    { sizeof(Ellipse), [](void* memory, int x, int y) -> Shape* { return new (memory) Ellipse(x, y); } },
+    { sizeof(Triangle), [](void* memory, int x, int y) -> Shape* { return new (memory) Triangle(x, y); } },
+    { sizeof(Line), [](void* memory, int x, int y) -> Shape* { return new (memory) Line(x, y); } }
+};
+
+Shape* Shape::create(ShapeKind kind, int x, int y) {
+    if (kind >= ShapeKind::Unknown) return nullptr;
+    const ShapeType& type = shape_types[size_t(kind)];
+    return type.construct(::operator new(type.size), x, y);
+}
+
+// ShapePool implementation
+static size_t pool_slot_size(ShapeKind kind) {
+    size_t align = alignof(std::max_align_t);
+    return (shape_types[size_t(kind)].size + align - 1) / align * align;
+}
+
+Shape* ShapePool::create(ShapeKind kind, int x, int y) {
+    if (kind >= ShapeKind::Unknown) return nullptr;
+
+    Slab& slab = slabs[size_t(kind)];
+    void* memory;
+    if (slab.free_list) {
+        memory = slab.free_list;
+        slab.free_list = slab.free_list->next;
+    }
+    else {
+        size_t slot_size = pool_slot_size(kind);
+        if (slab.used_in_last_chunk == CHUNK_SHAPES) {
+            slab.chunks.push_back(static_cast<char*>(::operator new(slot_size * CHUNK_SHAPES)));
+            slab.used_in_last_chunk = 0;
         }
+        memory = slab.chunks.back() + slot_size * slab.used_in_last_chunk++;
     }
+    return shape_types[size_t(kind)].construct(memory, x, y);
+}
 
-    // Удаляем указатели на выделенные фигуры
-    shapes.erase(std::remove_if(shapes.begin(), shapes.end(),
-        [](Shape* shape) { return shape->get_selected(); }),
-        shapes.end());
+void ShapePool::destroy(Shape* shape) {
+    Slab& slab = slabs[size_t(shape->get_kind())];
+    shape->~Shape();
+    FreeSlot* slot = reinterpret_cast<FreeSlot*>(shape);
+    slot->next = slab.free_list;
+    slab.free_list = slot;
+}
 
-    if (!selected_types.empty()) {
-        std::cout << "Deleted selected shapes: ";
-        for (size_t i = 0; i < selected_types.size(); ++i) {
-            std::cout << selected_types[i].toStdString();
-            if (i < selected_types.size() - 1) std::cout << ", ";
+void ShapePool::clear() {
+    for (Slab& slab : slabs) {
+        for (char* chunk : slab.chunks) {
+            ::operator delete(chunk);
         }
-        std::cout << std::endl;
+        slab.chunks.clear();
+        slab.used_in_last_chunk = CHUNK_SHAPES;
+        slab.free_list = nullptr;
     }
 }
 
-size_t ShapesContainer::size() const {
-    return shapes.size();
+// ShapeRecord implementation
+bool ShapeRecord::is_valid() const {
+    return kind < quint8(ShapeKind::Unknown) &&
+        x >= -MAX_COORDINATE && x <= MAX_COORDINATE && y >= -MAX_COORDINATE && y <= MAX_COORDINATE &&
+        width >= 0 && width <= MAX_EXTENT && height >= 0 && height <= MAX_EXTENT;
 }
 
-ShapesContainer::~ShapesContainer() {
-    for (Shape* shape : shapes) {
-        delete shape;
+ShapeRecord ShapeRecord::of(const Shape* shape) {
+    ShapeRecord record = {};
+    record.kind = quint8(shape->get_kind());
+    record.flags = shape->get_selected() ? SELECTED : 0;
+    record.line_width = quint8(qBound(0, shape->get_line_width(), 255));
+    record.selection_line_width = quint8(qBound(0, shape->get_selection_line_width(), 255));
+    record.x = shape->get_x();
+    record.y = shape->get_y();
+    record.width = shape->get_width();
+    record.height = shape->get_height();
+    record.color = shape->get_color().rgba();
+    record.selection_color = shape->get_selection_color().rgba();
+    return record;
+}
+
+void ShapeRecord::apply_to(Shape* shape) const {
+    shape->set_geometry(x, y, width, height);
+    shape->set_color(QColor::fromRgba(color));
+    shape->set_selection_color(QColor::fromRgba(selection_color));
+    shape->set_line_width(line_width);
+    shape->set_selection_line_width(selection_line_width);
+    shape->set_selected(flags & SELECTED);
+}
+
+// ShapeDocument implementation
+static const char shape_file_magic[4] = { 'S', 'H', 'P', 'D' };
+
+bool ShapeDocument::check_header(const ShapeFileHeader& header, qint64 file_size) {
+    if (std::memcmp(header.magic, shape_file_magic, sizeof(shape_file_magic)) != 0) return false;
+    if (header.version != VERSION || header.record_size != sizeof(ShapeRecord)) return false;
+    if (file_size < qint64(sizeof(ShapeFileHeader))) return false;
+    quint64 payload = quint64(file_size) - sizeof(ShapeFileHeader);
+    return header.count <= payload / sizeof(ShapeRecord);
+}
+
+bool ShapeDocument::open(const QString& path) {
+    close();
+    file.setFileName(path);
+    if (!file.open(QIODevice::ReadOnly)) return false;
+
+    qint64 file_size = file.size();
+    if (file_size < qint64(sizeof(ShapeFileHeader))) {
+        file.close();
+        return false;
     }
-    shapes.clear();
+    mapped = file.map(0, file_size);
+    if (!mapped) {
+        file.close();
+        return false;
+    }
+
+    const ShapeFileHeader* header = reinterpret_cast<const ShapeFileHeader*>(mapped);
+    if (!check_header(*header, file_size)) {
+        close();
+        return false;
+    }
+    records = reinterpret_cast<const ShapeRecord*>(mapped + sizeof(ShapeFileHeader));
+    count = size_t(header->count);
+    return true;
 }
 
-// Shape implementation
-Shape::Shape(int x, int y) : x(x), y(y), width(50), height(50),
-color(0, 0, 255), selection_color(255, 0, 0),
-line_width(2), selection_line_width(3), is_selected(false) {}
+QSize ShapeDocument::extent() const {
+    QSize size;
+    for (size_t i = 0; i < count; ++i) {
+        const ShapeRecord& record = records[i];
+        if (record.is_valid()) {
+            size = size.expandedTo(QSize(record.x + record.width, record.y + record.height));
+        }
+    }
+    return size;
+}
 
-bool Shape::move(int dx, int dy, int canvas_width, int canvas_height) {
-    int old_x = x, old_y = y;
-    int new_x = x + dx;
-    int new_y = y + dy;
-
-    if (new_x >= 0 && new_x <= canvas_width - width &&
-        new_y >= 0 && new_y <= canvas_height - height) {
-        x = new_x;
-        y = new_y;
-        std::cout << "Shape " << Shape::get_shape_type_name(this).toStdString()
-            << " moved from (" << old_x << ", " << old_y
-            << ") to (" << x << ", " << y << ")" << std::endl;
-        return true;
+void ShapeDocument::close() {
+    if (mapped) {
+        file.unmap(mapped);
+        mapped = nullptr;
     }
-    else {
-        std::cout << "Attempt to go out of bounds: "
-            << Shape::get_shape_type_name(this).toStdString() << " tried to go beyond canvas!" << std::endl;
+    if (file.isOpen()) file.close();
+    records = nullptr;
+    count = 0;
+}
+
+bool ShapeDocument::save(const ShapesContainer& container, const QString& path) {
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) return false;
+
+    ShapeFileHeader header = {};
+    std::memcpy(header.magic, shape_file_magic, sizeof(shape_file_magic));
+    header.version = VERSION;
+    header.record_size = sizeof(ShapeRecord);
+    header.count = container.size();
+    if (file.write(reinterpret_cast<const char*>(&header), sizeof(header)) != qint64(sizeof(header))) {
+        file.cancelWriting();
+        return false;
+    }
+
+    std::vector<ShapeRecord> chunk;
+    chunk.reserve(std::min(container.size(), STREAM_CHUNK_RECORDS));
+    auto write_chunk = [&]() {
+        qint64 bytes = qint64(chunk.size() * sizeof(ShapeRecord));
+        bool written = file.write(reinterpret_cast<const char*>(chunk.data()), bytes) == bytes;
+        chunk.clear();
+        return written;
+    };
+
+    for (const Shape* shape : container.get_all()) {
+        chunk.push_back(ShapeRecord::of(shape));
+
+        if (chunk.size() == STREAM_CHUNK_RECORDS && !write_chunk()) {
+            file.cancelWriting();
+            return false;
+        }
+    }
+    if (!chunk.empty() && !write_chunk()) {
+        file.cancelWriting();
         return false;
     }
+    return file.commit();
 }
 
-bool Shape::resize(int dw, int dh, int canvas_width, int canvas_height) {
-    int old_width = width, old_height = height;
-    int new_width = width + dw;
-    int new_height = height + dh;
+bool ShapeDocument::import(const QString& path, ShapesContainer& container, const QRect& viewport) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) return false;
+
+    ShapeFileHeader header;
+    if (file.read(reinterpret_cast<char*>(&header), sizeof(header)) != qint64(sizeof(header))) return false;
+    if (!check_header(header, file.size())) return false;
+
+    // Without a viewport every record becomes a shape, so size the arrays once
+    if (viewport.isNull()) container.reserve(container.size() + size_t(header.count));
+
+    std::vector<ShapeRecord> chunk(size_t(std::min<quint64>(header.count, STREAM_CHUNK_RECORDS)));
+    quint64 remaining = header.count;
+    while (remaining > 0) {
+        size_t chunk_count = size_t(std::min<quint64>(remaining, STREAM_CHUNK_RECORDS));
+        qint64 bytes = qint64(chunk_count * sizeof(ShapeRecord));
+        if (file.read(reinterpret_cast<char*>(chunk.data()), bytes) != bytes) return false;
+        remaining -= chunk_count;
+
+        for (size_t i = 0; i < chunk_count; ++i) {
+            // Unknown kinds from a newer writer and corrupt geometry are skipped
+            const ShapeRecord& record = chunk[i];
+            if (!record.is_valid()) continue;
+            if (!viewport.isNull() && !viewport.intersects(QRect(record.x, record.y,
+                record.width + 1, record.height + 1))) {
+                continue;
+            }
 
-    if (new_width > 0 && new_height > 0 &&
-        x + new_width <= canvas_width &&
-        y + new_height <= canvas_height) {
-        width = new_width;
-        height = new_height;
-        std::cout << "Shape " << Shape::get_shape_type_name(this).toStdString()
-            << " resized from (" << old_width << ", " << old_height
-            << ") to (" << width << ", " << height << ")" << std::endl;
-        return true;
+            container.create(record); // unknown kinds from a newer writer are skipped
+        }
+    }
+    return true;
+}
+
+// EditHistory implementation
+size_t EditCommand::memory_size() const {
+    return sizeof(EditCommand) + ids.capacity() * sizeof(ShapeId) + old_colors.capacity() * sizeof(QRgb) +
+        offsets.capacity() * sizeof(QPoint) + records.capacity() * sizeof(ShapeRecord) +
+        positions.capacity() * sizeof(quint32);
+}
+
+void EditHistory::push(EditCommand command) {
+    undone.clear();
+
+    bool mergeable = command.type == EditCommand::Move || command.type == EditCommand::Resize;
+    // Comparing selection generations instead of the id lists keeps this O(1)
+    if (mergeable && can_merge && !done.empty() && done.back().type == command.type &&
+        command.selection != 0 && done.back().selection == command.selection) {
+        // Holding an arrow key produces one command instead of one per repeat
+        done.back().dx += command.dx;
+        done.back().dy += command.dy;
     }
     else {
-        std::cout << "Attempt to go out of bounds: failed to resize "
-            << Shape::get_shape_type_name(this).toStdString()
-            << " by " << dw << ", " << dh << std::endl;
-        return false;
+        command.ids.shrink_to_fit();
+        command.old_colors.shrink_to_fit();
+        command.offsets.shrink_to_fit();
+        command.records.shrink_to_fit();
+        command.positions.shrink_to_fit();
+        memory_used += command.memory_size();
+        done.push_back(std::move(command));
     }
+    can_merge = mergeable;
+    trim();
 }
 
-void Shape::adjust_to_bounds(int canvas_width, int canvas_height) {
-    int old_x = x, old_y = y;
-    bool adjusted = false;
+void EditHistory::trim() {
+    while (memory_used > memory_limit && !done.empty()) {
+        memory_used -= done.front().memory_size();
+        done.pop_front();
+    }
+}
 
-    if (x + width > canvas_width) {
-        x = std::max(0, canvas_width - width);
-        adjusted = true;
+bool EditHistory::undo(ShapesContainer& container, const std::function<void(const Shape*)>& touched) {
+    if (done.empty()) return false;
+
+    EditCommand command = std::move(done.back());
+    done.pop_back();
+    memory_used -= command.memory_size();
+
+    apply(command, false, container, touched);
+    log_event(LogLevel::Info, LogEvent::Undone, ShapeKind::Unknown, command.type, int(command.ids.size()));
+
+    memory_used += command.memory_size();
+    undone.push_back(std::move(command));
+    can_merge = false;
+    return true;
+}
+
+bool EditHistory::redo(ShapesContainer& container, const std::function<void(const Shape*)>& touched) {
+    if (undone.empty()) return false;
+
+    EditCommand command = std::move(undone.back());
+    undone.pop_back();
+    memory_used -= command.memory_size();
+
+    apply(command, true, container, touched);
+    log_event(LogLevel::Info, LogEvent::Redone, ShapeKind::Unknown, command.type, int(command.ids.size()));
+
+    memory_used += command.memory_size();
+    done.push_back(std::move(command));
+    can_merge = false;
+    return true;
+}
+
+void EditHistory::apply(EditCommand& command, bool forward, ShapesContainer& container,
+    const std::function<void(const Shape*)>& touched) {
+    // Creating is undone by deleting and the other way round
+    bool bring_back = (command.type == EditCommand::Create) == forward;
+    int sign = forward ? 1 : -1;
+
+    if (command.type == EditCommand::Create || command.type == EditCommand::Delete) {
+        // Shapes leave and come back in one pass over the container each, and
+        // come back at their old places in drawing order
+        std::vector<Shape*> shapes;
+        if (bring_back) {
+            container.restore(command.ids, command.records, command.positions, shapes);
+            for (const Shape* shape : shapes) touched(shape);
+            return;
+        }
+
+        for (ShapeId id : command.ids) {
+            if (Shape* shape = container.find(id)) shapes.push_back(shape);
+        }
+        std::sort(shapes.begin(), shapes.end(),
+            [](const Shape* a, const Shape* b) { return a->get_slot() < b->get_slot(); });
+        command.ids.clear();
+        command.records.clear();
+        command.positions.clear();
+        for (Shape* shape : shapes) {
+            command.ids.push_back(shape->get_id());
+            command.records.push_back(ShapeRecord::of(shape));
+            command.positions.push_back(quint32(shape->get_slot()));
+            touched(shape);
+        }
+        container.remove_ordered(shapes);
+        return;
     }
-    if (y + height > canvas_height) {
-        y = std::max(0, canvas_height - height);
-        adjusted = true;
+
+    for (size_t i = 0; i < command.ids.size(); ++i) {
+        ShapeId id = command.ids[i];
+        Shape* shape = container.find(id);
+        if (!shape) continue;
+        touched(shape);
+
+        switch (command.type) {
+        case EditCommand::Move:
+            shape->set_geometry(shape->get_x() + sign * command.dx, shape->get_y() + sign * command.dy,
+                shape->get_width(), shape->get_height());
+            break;
+        case EditCommand::Resize:
+            shape->set_geometry(shape->get_x(), shape->get_y(),
+                shape->get_width() + sign * command.dx, shape->get_height() + sign * command.dy);
+            break;
+        case EditCommand::Recolor:
+            shape->set_color(QColor::fromRgba(forward ? command.new_color : command.old_colors[i]));
+            break;
+        case EditCommand::Adjust:
+            shape->set_geometry(shape->get_x() + sign * command.offsets[i].x(),
+                shape->get_y() + sign * command.offsets[i].y(), shape->get_width(), shape->get_height());
+            break;
+        default:
+            break;
+        }
+        touched(shape);
     }
-    if (x < 0) {
-        x = 0;
-        adjusted = true;
+}
+
+void EditHistory::clear() {
+    done.clear();
+    undone.clear();
+    memory_used = 0;
+    can_merge = false;
+}
+
+// ShapeBatcher implementation
+ShapeBatcher::ShapeBatcher() : band_cells(BAND_SLOTS, BandCell{ 0, 0 }), band(0) {}
+
+quint64 ShapeBatcher::make_key(ShapeKind kind, const QColor& color, int line_width) {
+    return (quint64(kind) << 48) | (quint64(quint16(line_width)) << 32) | color.rgba();
+}
+
+quint64 ShapeBatcher::key_at_scale(ShapeKind kind, const QColor& color, int line_width,
+    int width, int height, qreal scale) {
+    if (std::max(width, height) * scale < 1.0) {
+        // Pen width 0 is a cosmetic one-pixel pen at any zoom
+        return make_key(ShapeKind::Unknown, color, 0);
     }
-    if (y < 0) {
-        y = 0;
-        adjusted = true;
+    return make_key(kind, color, line_width);
+}
+
+QPen ShapeBatcher::pen_of(quint64 key) {
+    return QPen(QColor::fromRgba(QRgb(key & 0xffffffff)), int((key >> 32) & 0xffff));
+}
+
+void ShapeBatcher::draw(QPainter& painter, const std::vector<Shape*>& shapes) {
+    painter.setBrush(Qt::NoBrush);
+    qreal scale = painter.worldTransform().m11();
+
+    items.clear();
+    for (const Shape* shape : shapes) {
+        int w = shape->get_width(), h = shape->get_height();
+        items.push_back({ key_at_scale(shape->get_kind(), shape->get_color(), shape->get_line_width(), w, h, scale),
+            shape->get_x(), shape->get_y(), w, h });
     }
+    draw_groups(painter, false);
 
-    if (adjusted) {
-        std::cout << "Shape " << Shape::get_shape_type_name(this).toStdString()
-            << " adjusted when canvas resized: from (" << old_x << ", " << old_y
-            << ") to (" << x << ", " << y << ")" << std::endl;
+    items.clear();
+    for (const Shape* shape : shapes) {
+        if (shape->get_selected()) {
+            int w = shape->get_width(), h = shape->get_height();
+            items.push_back({ key_at_scale(shape->get_kind(), shape->get_selection_color(),
+                shape->get_selection_line_width(), w, h, scale),
+                shape->get_x(), shape->get_y(), w, h });
+        }
     }
+    draw_groups(painter, true);
 }
 
-QString Shape::get_shape_type_name(const Shape* shape) {
-    if (dynamic_cast<const Circle*>(shape)) return "Circle";
-    if (dynamic_cast<const Rectangle*>(shape)) return "Rectangle";
-    if (dynamic_cast<const Square*>(shape)) return "Square";
-    if (dynamic_cast<const Ellipse*>(shape)) return "Ellipse";
-    if (dynamic_cast<const Triangle*>(shape)) return "Triangle";
-    if (dynamic_cast<const Line*>(shape)) return "Line";
-    return "Unknown";
+void ShapeBatcher::draw(QPainter& painter, const ShapeRecord* records, size_t count, const QRect& clip) {
+    painter.setBrush(Qt::NoBrush);
+    qreal scale = painter.worldTransform().m11();
+
+    auto visible = [&](const ShapeRecord& record) {
+        if (!record.is_valid()) return false;
+        if (clip.isNull()) return true;
+        return clip.intersects(QRect(record.x - Shape::BOUNDS_MARGIN, record.y - Shape::BOUNDS_MARGIN,
+            record.width + 2 * Shape::BOUNDS_MARGIN + 1, record.height + 2 * Shape::BOUNDS_MARGIN + 1));
+    };
+
+    items.clear();
+    for (size_t i = 0; i < count; ++i) {
+        const ShapeRecord& record = records[i];
+        if (!visible(record)) continue;
+        items.push_back({ key_at_scale(ShapeKind(record.kind), QColor::fromRgba(record.color), record.line_width,
+            record.width, record.height, scale), record.x, record.y, record.width, record.height });
+    }
+    draw_groups(painter, false);
+
+    items.clear();
+    for (size_t i = 0; i < count; ++i) {
+        const ShapeRecord& record = records[i];
+        if (!(record.flags & ShapeRecord::SELECTED) || !visible(record)) continue;
+        items.push_back({ key_at_scale(ShapeKind(record.kind), QColor::fromRgba(record.selection_color),
+            record.selection_line_width, record.width, record.height, scale),
+            record.x, record.y, record.width, record.height });
+    }
+    draw_groups(painter, true);
 }
 
-// Circle implementation
-Circle::Circle(int x, int y) : Shape(x, y) {
-    selection_color = QColor(255, 69, 0); // Orange
+bool ShapeBatcher::claim(const Item& item) {
+    auto cell_of = [](int v) { return v >= 0 ? v / BAND_CELL : (v + 1) / BAND_CELL - 1; };
+    QRect bounds(item.x - Shape::BOUNDS_MARGIN, item.y - Shape::BOUNDS_MARGIN,
+        item.width + 2 * Shape::BOUNDS_MARGIN + 1, item.height + 2 * Shape::BOUNDS_MARGIN + 1);
+    int left = cell_of(bounds.left()), right = cell_of(bounds.right());
+    int top = cell_of(bounds.top()), bottom = cell_of(bounds.bottom());
+    if ((right - left + 1) * (bottom - top + 1) > MAX_BAND_CELLS) return false;
+
+    auto slot_of = [](int cx, int cy) {
+        return (quint32(cx) * 73856093u ^ quint32(cy) * 19349663u) & (BAND_SLOTS - 1);
+    };
+    for (int cy = top; cy <= bottom; ++cy) {
+        for (int cx = left; cx <= right; ++cx) {
+            const BandCell& cell = band_cells[slot_of(cx, cy)];
+            if (cell.band == band && cell.key != item.key) return false;
+        }
+    }
+    for (int cy = top; cy <= bottom; ++cy) {
+        for (int cx = left; cx <= right; ++cx) {
+            band_cells[slot_of(cx, cy)] = { band, item.key };
+        }
+    }
+    return true;
 }
 
-void Circle::draw(QPainter& painter) {
-    QPen pen(color, line_width);
-    painter.setPen(pen);
-    painter.drawEllipse(get_x(), get_y(), get_width(), get_height());
+void ShapeBatcher::draw_groups(QPainter& painter, bool outlines) {
+    size_t first = 0;
+    ++band;
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (claim(items[i])) continue;
+        // A conflict ends the band; an oversized shape also gets one to itself
+        if (i > first) {
+            draw_band(painter, first, i, outlines);
+            first = i;
+            ++band;
+            if (claim(items[i])) continue;
+        }
+        draw_band(painter, i, i + 1, outlines);
+        first = i + 1;
+        ++band;
+    }
+    draw_band(painter, first, items.size(), outlines);
+}
 
-    if (is_selected) {
-        QPen selection_pen(selection_color, selection_line_width);
-        painter.setPen(selection_pen);
-        painter.setBrush(QBrush(QColor(0, 0, 0, 0)));
-        painter.drawEllipse(get_x() - 3, get_y() - 3, get_width() + 6, get_height() + 6);
+void ShapeBatcher::draw_band(QPainter& painter, size_t band_first, size_t band_last, bool outlines) {
+    std::sort(items.begin() + std::ptrdiff_t(band_first), items.begin() + std::ptrdiff_t(band_last),
+        [](const Item& a, const Item& b) { return a.key < b.key; });
+
+    size_t first = band_first;
+    while (first < band_last) {
+        size_t last = first;
+        while (last < band_last && items[last].key == items[first].key) ++last;
+
+        painter.setPen(pen_of(items[first].key));
+        submit(painter, ShapeKind(items[first].key >> 48), first, last, outlines);
+        first = last;
     }
 }
 
-bool Circle::contains(const QPoint& point) const {
-    int center_x = get_x() + get_width() / 2;
-    int center_y = get_y() + get_height() / 2;
-    int radius = get_width() / 2;
-    int dx = point.x() - center_x;
-    int dy = point.y() - center_y;
-    return (dx * dx + dy * dy) <= (radius * radius);
+void ShapeBatcher::submit(QPainter& painter, ShapeKind kind, size_t first, size_t last, bool outlines) {
+    // Selection outlines are drawn 3px outside the shape, as in Shape::draw
+    int grow = outlines ? 3 : 0;
+
+    switch (kind) {
+    case ShapeKind::Rectangle:
+    case ShapeKind::Square:
+        rects.clear();
+        for (size_t i = first; i < last; ++i) {
+            const Item& item = items[i];
+            rects.push_back(QRect(item.x - grow, item.y - grow,
+                item.width + 2 * grow, item.height + 2 * grow));
+        }
+        painter.drawRects(rects.data(), int(rects.size()));
+        break;
+
+    case ShapeKind::Line:
+        if (outlines) {
+            rects.clear();
+            for (size_t i = first; i < last; ++i) {
+                const Item& item = items[i];
+                rects.push_back(QRect(item.x - 3, item.y - 3, item.width + 6, item.height + 6));
+            }
+            painter.drawRects(rects.data(), int(rects.size()));
+        }
+        else {
+            lines.clear();
+            for (size_t i = first; i < last; ++i) {
+                const Item& item = items[i];
+                lines.push_back(QLine(item.x, item.y, item.x + item.width, item.y + item.height));
+            }
+            painter.drawLines(lines.data(), int(lines.size()));
+        }
+        break;
+
+    case ShapeKind::Circle:
+    case ShapeKind::Ellipse:
+    case ShapeKind::Triangle:
+        for (size_t chunk = first; chunk < last; chunk += MAX_PATH_SHAPES) {
+            size_t chunk_end = std::min(last, chunk + size_t(MAX_PATH_SHAPES));
+            QPainterPath path;
+            for (size_t i = chunk; i < chunk_end; ++i) {
+                const Item& item = items[i];
+                int x = item.x, y = item.y;
+                int w = item.width, h = item.height;
+                if (kind == ShapeKind::Triangle) {
+                    QPolygon polygon;
+                    polygon << QPoint(x + w / 2, y) << QPoint(x, y + h) << QPoint(x + w, y + h);
+                    path.addPolygon(polygon);
+                    path.closeSubpath();
+                }
+                else {
+                    path.addEllipse(QRectF(x - grow, y - grow, w + 2 * grow, h + 2 * grow));
+                }
+            }
+            painter.drawPath(path);
+        }
+        break;
+
+    case ShapeKind::Unknown:
+        // Sub-pixel shapes, outlines included, collapse to their centre
+        points.clear();
+        for (size_t i = first; i < last; ++i) {
+            const Item& item = items[i];
+            points.push_back(QPoint(item.x + item.width / 2, item.y + item.height / 2));
+        }
+        painter.drawPoints(points.data(), int(points.size()));
+        break;
+
+    default:
+        break;
+    }
+}
+
+// WorkerPool implementation
+WorkerPool::WorkerPool(int thread_count) : job(nullptr), next_index(0), job_count(0),
+busy_workers(0), generation(0), stopping(false) {
+    if (thread_count <= 0) {
+        thread_count = std::max(1, int(std::thread::hardware_concurrency()));
+    }
+    for (int i = 1; i < thread_count; ++i) {
+        threads.emplace_back(&WorkerPool::worker_loop, this);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
 }
 
-// Rectangle implementation
-Rectangle::Rectangle(int x, int y) : Shape(x, y) {
-    set_width(80);
-    set_height(40);
-    selection_color = QColor(0, 255, 255); // Cyan
+void WorkerPool::run_jobs() {
+    for (size_t i = next_index++; i < job_count; i = next_index++) {
+        (*job)(i);
+    }
+}
+
+void WorkerPool::worker_loop() {
+    quint64 seen_generation = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || generation != seen_generation; });
+            if (stopping) return;
+            seen_generation = generation;
+        }
+        run_jobs();
+
+        // Every worker checks in once per batch, even if it found no work left
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--busy_workers == 0) {
+            finished.notify_one();
+        }
+    }
+}
+
+void WorkerPool::parallel_for(size_t count, const std::function<void(size_t)>& job) {
+    if (count == 0) return;
+    if (threads.empty() || count == 1) {
+        for (size_t i = 0; i < count; ++i) job(i);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->job = &job;
+        job_count = count;
+        next_index = 0;
+        busy_workers = int(threads.size());
+        ++generation;
+    }
+    wake.notify_all();
+    run_jobs();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [&] { return busy_workers == 0; });
+    this->job = nullptr;
+}
+
+// TiledRenderer implementation
+QImage TiledRenderer::render(const ShapesContainer& container, const QSize& size, const QColor& background) {
+    QImage result(size, QImage::Format_ARGB32_Premultiplied);
+    if (size.isEmpty()) return result;
+
+    int columns = (size.width() + TILE_SIZE - 1) / TILE_SIZE;
+    int rows = (size.height() + TILE_SIZE - 1) / TILE_SIZE;
+
+    // Bin shapes into every tile their bounds overlap, keeping drawing order
+    std::vector<std::vector<Shape*>> bins(size_t(columns) * rows);
+    for (Shape* shape : container) {
+        QRect bounds = shape->get_bounds();
+        int first_column = std::max(0, bounds.left() / TILE_SIZE);
+        int last_column = std::min(columns - 1, bounds.right() / TILE_SIZE);
+        int first_row = std::max(0, bounds.top() / TILE_SIZE);
+        int last_row = std::min(rows - 1, bounds.bottom() / TILE_SIZE);
+        for (int row = first_row; row <= last_row; ++row) {
+            for (int column = first_column; column <= last_column; ++column) {
+                bins[size_t(row) * columns + column].push_back(shape);
+            }
+        }
+    }
+
+    // Tiles cover disjoint rows of the result, so workers copy into it directly
+    uchar* pixels = result.bits();
+    qsizetype stride = result.bytesPerLine();
+
+    pool.parallel_for(bins.size(), [&](size_t index) {
+        int left = int(index % columns) * TILE_SIZE;
+        int top = int(index / columns) * TILE_SIZE;
+        int tile_width = std::min(TILE_SIZE, size.width() - left);
+        int tile_height = std::min(TILE_SIZE, size.height() - top);
+
+        QImage tile(tile_width, tile_height, QImage::Format_ARGB32_Premultiplied);
+        tile.fill(background);
+        if (!bins[index].empty()) {
+            QPainter painter(&tile);
+            painter.setRenderHint(QPainter::Antialiasing);
+            painter.translate(-left, -top);
+            ShapeBatcher batcher;
+            batcher.draw(painter, bins[index]);
+        }
+
+        for (int y = 0; y < tile_height; ++y) {
+            std::memcpy(pixels + (top + y) * stride + left * 4, tile.constScanLine(y), size_t(tile_width) * 4);
+        }
+    });
+    return result;
 }
 
-void Rectangle::draw(QPainter& painter) {
-    QPen pen(color, line_width);
-    painter.setPen(pen);
-    painter.drawRect(get_x(), get_y(), get_width(), get_height());
+// Viewport implementation
+static int clamp_coord(double value) {
+    // Far-away shapes at high zoom must not overflow QRect
+    return int(std::max(-1e9, std::min(1e9, value)));
+}
 
-    if (is_selected) {
-        QPen selection_pen(selection_color, selection_line_width);
-        painter.setPen(selection_pen);
-        painter.setBrush(QBrush(QColor(0, 0, 0, 0)));
-        painter.drawRect(get_x() - 3, get_y() - 3, get_width() + 6, get_height() + 6);
-    }
+QPoint Viewport::to_world(const QPoint& screen) const {
+    return QPoint(clamp_coord(std::floor(origin.x() + screen.x() / zoom)),
+        clamp_coord(std::floor(origin.y() + screen.y() / zoom)));
 }
 
-bool Rectangle::contains(const QPoint& point) const {
-    return (point.x() >= get_x() && point.x() <= get_x() + get_width() &&
-        point.y() >= get_y() && point.y() <= get_y() + get_height());
+QRect Viewport::to_world(const QRect& screen) const {
+    // Pixel `right` spans [right, right + 1)
+    return QRect(QPoint(clamp_coord(std::floor(origin.x() + screen.left() / zoom)),
+                        clamp_coord(std::floor(origin.y() + screen.top() / zoom))),
+                 QPoint(clamp_coord(std::floor(origin.x() + (screen.right() + 1) / zoom)),
+                        clamp_coord(std::floor(origin.y() + (screen.bottom() + 1) / zoom))));
 }
 
-// Square implementation
-Square::Square(int x, int y) : Shape(x, y) {
-    set_width(50);
-    set_height(50);
-    selection_color = QColor(255, 0, 255); // Magenta
+QRect Viewport::to_screen(const QRect& world) const {
+    return QRect(QPoint(clamp_coord(std::floor((world.left() - origin.x()) * zoom)),
+                        clamp_coord(std::floor((world.top() - origin.y()) * zoom))),
+                 QPoint(clamp_coord(std::ceil((world.right() + 1 - origin.x()) * zoom)),
+                        clamp_coord(std::ceil((world.bottom() + 1 - origin.y()) * zoom))));
 }
 
-void Square::draw(QPainter& painter) {
-    QPen pen(color, line_width);
-    painter.setPen(pen);
-    painter.drawRect(get_x(), get_y(), get_width(), get_height());
+void Viewport::zoom_at(const QPoint& anchor, double factor) {
+    double new_zoom = std::max(MIN_ZOOM, std::min(MAX_ZOOM, zoom * factor));
+    origin += QPointF(anchor) / zoom - QPointF(anchor) / new_zoom;
+    zoom = new_zoom;
+}
 
-    if (is_selected) {
-        QPen selection_pen(selection_color, selection_line_width);
-        painter.setPen(selection_pen);
-        painter.setBrush(QBrush(QColor(0, 0, 0, 0)));
-        painter.drawRect(get_x() - 3, get_y() - 3, get_width() + 6, get_height() + 6);
-    }
+void Viewport::pan(const QPoint& screen_delta) {
+    origin -= QPointF(screen_delta) / zoom;
 }
 
-bool Square::contains(const QPoint& point) const {
-    return (point.x() >= get_x() && point.x() <= get_x() + get_width() &&
-        point.y() >= get_y() && point.y() <= get_y() + get_height());
+// CanvasWidget implementation
+CanvasWidget::CanvasWidget(QWidget* parent) : QWidget(parent), current_shape_kind(ShapeKind::Unknown),
+damage_rect_count(0), loading_next(0), selection_tool(SelectionTool::None), region_dragging(false),
+panning(false), profiler_overlay(false), pending_resizing(false), canvas_resize_pending(false) {
+    setFocusPolicy(Qt::StrongFocus);
+    load_timer.setInterval(0);
+    connect(&load_timer, &QTimer::timeout, this, &CanvasWidget::load_step);
+    frame_timer.setSingleShot(true);
+    frame_timer.setTimerType(Qt::PreciseTimer);
+    connect(&frame_timer, &QTimer::timeout, this, &CanvasWidget::apply_pending_input);
 }
 
-// Ellipse implementation
-Ellipse::Ellipse(int x, int y) : Shape(x, y) {
-    set_width(70);
-    set_height(40);
-    selection_color = QColor(128, 128, 0); // Olive
+void CanvasWidget::invalidate() {
+    static_damage = QRegion(rect());
+    update();
 }
 
-void Ellipse::draw(QPainter& painter) {
-    QPen pen(color, line_width);
-    painter.setPen(pen);
-    painter.drawEllipse(get_x(), get_y(), get_width(), get_height());
+QRect CanvasWidget::screen_bounds(const Shape* shape) const {
+    // One extra pixel for antialiasing of the selection outline
+    return viewport.to_screen(shape->get_bounds()).adjusted(-1, -1, 1, 1) & rect();
+}
 
-    if (is_selected) {
-        QPen selection_pen(selection_color, selection_line_width);
-        painter.setPen(selection_pen);
-        painter.setBrush(QBrush(QColor(0, 0, 0, 0)));
-        painter.drawEllipse(get_x() - 3, get_y() - 3, get_width() + 6, get_height() + 6);
+void CanvasWidget::damage(const Shape* shape) {
+    damage_region += screen_bounds(shape);
+    if (++damage_rect_count > MAX_DAMAGE_RECTS) {
+        // Too many scattered rects cost more to clip than to repaint their hull
+        damage_region = QRegion(damage_region.boundingRect());
+        damage_rect_count = 1;
     }
 }
 
-bool Ellipse::contains(const QPoint& point) const {
-    int center_x = get_x() + get_width() / 2;
-    int center_y = get_y() + get_height() / 2;
-    double dx = (point.x() - center_x) / (get_width() / 2.0);
-    double dy = (point.y() - center_y) / (get_height() / 2.0);
-    return (dx * dx + dy * dy) <= 1.0;
+void CanvasWidget::damage_static(const Shape* shape) {
+    // The shape enters or leaves the cached layer
+    static_damage += screen_bounds(shape);
+    if (static_damage.rectCount() > MAX_DAMAGE_RECTS) {
+        // Same trade-off as damage(): a large selection change redraws the hull
+        // of the layer
+        static_damage = QRegion(static_damage.boundingRect());
+    }
+    damage(shape);
 }
 
-// Triangle implementation
-Triangle::Triangle(int x, int y) : Shape(x, y) {
-    set_width(60);
-    set_height(60);
-    selection_color = QColor(0, 128, 128); // Teal
+void CanvasWidget::damage_selection_change() {
+    // Shapes whose selection flipped since previous_selection; the diff costs one
+    // pass over the words, and large changes only collect the hull of each side
+    const std::vector<quint64>& current = shapes_container.get_selection().data();
+    const std::vector<Shape*>& shapes = shapes_container.get_all();
+    size_t words = std::min(current.size(), previous_selection.size());
+    size_t selected = 0, deselected = 0;
+    for (size_t w = 0; w < words; ++w) {
+        selected += size_t(count_bits(current[w] & ~previous_selection[w]));
+        deselected += size_t(count_bits(previous_selection[w] & ~current[w]));
+    }
+    bool hull_selected = selected > size_t(MAX_DAMAGE_RECTS);
+    bool hull_deselected = deselected > size_t(MAX_DAMAGE_RECTS);
+    QRect selected_hull, deselected_hull;
+
+    for (size_t w = 0; w < words; ++w) {
+        // Newly selected shapes are drawn by the overlay right over their copy
+        // in the cached layer, which is only dropped once they change
+        for (quint64 word = current[w] & ~previous_selection[w]; word; word &= word - 1) {
+            const Shape* shape = shapes[(w << 6) + size_t(lowest_set_bit(word))];
+            QRect bounds = screen_bounds(shape);
+            stale_static |= bounds;
+            if (hull_selected) selected_hull |= bounds;
+            else damage(shape);
+        }
+        // Deselected ones have to be drawn into it
+        for (quint64 word = previous_selection[w] & ~current[w]; word; word &= word - 1) {
+            const Shape* shape = shapes[(w << 6) + size_t(lowest_set_bit(word))];
+            if (hull_deselected) deselected_hull |= screen_bounds(shape);
+            else damage_static(shape);
+        }
+    }
+    if (!selected_hull.isEmpty()) {
+        damage_region += selected_hull;
+        ++damage_rect_count;
+    }
+    if (!deselected_hull.isEmpty()) {
+        static_damage += deselected_hull;
+        damage_region += deselected_hull;
+        ++damage_rect_count;
+    }
 }
 
-void Triangle::draw(QPainter& painter) {
-    QPolygon polygon;
-    polygon << QPoint(get_x() + get_width() / 2, get_y())
-        << QPoint(get_x(), get_y() + get_height())
-        << QPoint(get_x() + get_width(), get_y() + get_height());
-
-    QPen pen(color, line_width);
-    painter.setPen(pen);
-    painter.drawPolygon(polygon);
+void CanvasWidget::drop_stale_copies() {
+    // Called before selected shapes move, change or go away
+    if (stale_static.isEmpty()) return;
+    static_damage += stale_static;
+    stale_static = QRect();
+}
 
-    if (is_selected) {
-        QPen selection_pen(selection_color, selection_line_width);
-        painter.setPen(selection_pen);
-        painter.setBrush(QBrush(QColor(0, 0, 0, 0)));
-        painter.drawPolygon(polygon);
+void CanvasWidget::flush_damage() {
+    profile_count(ProfileCounter::DamageRects, quint64(damage_rect_count));
+    if (profiler_overlay) {
+        damage_region += profiler_overlay_rect();
+    }
+    if (!damage_region.isEmpty()) {
+        update(damage_region);
     }
+    damage_region = QRegion();
+    damage_rect_count = 0;
 }
 
-bool Triangle::contains(const QPoint& point) const {
-    return (point.x() >= get_x() && point.x() <= get_x() + get_width() &&
-        point.y() >= get_y() && point.y() <= get_y() + get_height());
+QRect CanvasWidget::region_overlay() const {
+    QRect world = selection_tool == SelectionTool::Lasso ? lasso.bounds() : band_rect;
+    return viewport.to_screen(world).adjusted(-2, -2, 2, 2);
 }
 
-// Line implementation
-Line::Line(int x, int y) : Shape(x, y) {
-    set_width(80);
-    set_height(2);
-    selection_color = QColor(128, 0, 128); // Purple
-    line_width = 3;
-    selection_line_width = 4;
+void CanvasWidget::update_region_selection() {
+    if (selection_tool == SelectionTool::Lasso) {
+        shapes_container.region_hit_test(lasso, region_hits);
+    }
+    else {
+        shapes_container.region_hit_test(band_rect, region_hits);
+    }
+
+    previous_selection = shapes_container.get_selection().data();
+    base_selection.resize(region_hits.size()); // an undo during the drag may add shapes
+    if (region_modifiers & Qt::ControlModifier) {
+        shapes_container.select_only(base_selection);
+        shapes_container.toggle_selection(region_hits);
+    }
+    else if (region_modifiers & Qt::ShiftModifier) {
+        shapes_container.select_only(base_selection);
+        shapes_container.add_to_selection(region_hits);
+    }
+    else {
+        shapes_container.select_only(region_hits);
+    }
+
+    // Newly selected shapes go to the overlay, however many there are; only
+    // deselected ones are redrawn into the cached layer
+    damage_selection_change();
 }
 
-void Line::draw(QPainter& painter) {
-    QPen pen(color, line_width);
-    painter.setPen(pen);
-    painter.drawLine(get_x(), get_y(), get_x() + get_width(), get_y() + get_height());
+void CanvasWidget::refresh_static_layer() {
+    qreal ratio = devicePixelRatioF();
+    QSize pixel_size = size() * ratio;
+    if (static_layer.size() != pixel_size) {
+        static_layer = QImage(pixel_size, QImage::Format_ARGB32_Premultiplied);
+        static_layer.setDevicePixelRatio(ratio);
+        static_damage = QRegion(rect());
+    }
+    if (static_damage.isEmpty()) return;
 
-    if (is_selected) {
-        QPen selection_pen(selection_color, selection_line_width);
-        painter.setPen(selection_pen);
-        painter.drawRect(get_x() - 3, get_y() - 3, get_width() + 6, get_height() + 6);
+    QPainter painter(&static_layer);
+    painter.setRenderHint(QPainter::Antialiasing);
+    painter.setClipRegion(static_damage);
+    painter.setCompositionMode(QPainter::CompositionMode_Source);
+    painter.fillRect(static_damage.boundingRect(), Qt::transparent);
+    painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+    painter.setTransform(viewport.transform());
+    if (static_damage.rectCount() == 1 && static_damage.boundingRect().contains(stale_static)) {
+        stale_static = QRect();
     }
-}
 
-bool Line::contains(const QPoint& point) const {
-    return (point.x() >= get_x() - 5 && point.x() <= get_x() + get_width() + 5 &&
-        point.y() >= get_y() - 5 && point.y() <= get_y() + get_height() + 5);
-}
+    QRect damaged = viewport.to_world(static_damage.boundingRect());
+    if (loading_document) {
+        // A document being loaded is drawn straight from its mapped records
+        batcher.draw(painter, loading_document->data(), loading_document->size(), damaged);
+        static_damage = QRegion();
+        return;
+    }
 
-// CanvasWidget implementation
-CanvasWidget::CanvasWidget(QWidget* parent) : QWidget(parent) {
-    setFocusPolicy(Qt::StrongFocus);
-    current_shape_type = "";
+    exposed_shapes.clear();
+    shapes_container.shapes_in(damaged, exposed_shapes);
+    exposed_shapes.erase(std::remove_if(exposed_shapes.begin(), exposed_shapes.end(),
+        [](Shape* shape) { return shape->get_selected(); }),
+        exposed_shapes.end());
+    batcher.draw(painter, exposed_shapes);
+    profile_count(ProfileCounter::ShapesDrawn, exposed_shapes.size());
+    static_damage = QRegion();
 }
 
 void CanvasWidget::paintEvent(QPaintEvent* event) {
-    QPainter painter(this);
-    painter.setRenderHint(QPainter::Antialiasing);
+    ProfileScope scope(ProfileZone::Paint);
+    // A resize repaints the whole canvas anyway, adjust the shapes before it
+    if (canvas_resize_pending) {
+        apply_canvas_resize();
+    }
+    refresh_static_layer();
 
-    // Draw non-selected shapes first
-    for (Shape* shape : shapes_container.get_all()) {
-        if (!shape->get_selected()) {
-            shape->draw(painter);
+    QPainter painter(this);
+    const QRegion& exposed = event->region();
+    qreal ratio = static_layer.devicePixelRatio();
+    for (const QRect& area : exposed) {
+        QRect source(qRound(area.x() * ratio), qRound(area.y() * ratio),
+            qRound(area.width() * ratio), qRound(area.height() * ratio));
+        painter.drawImage(area, static_layer, source);
+    }
+    // Draw selected shapes on top; the records of a document being loaded
+    // already carry the selection outlines
+    if (!loading_document) {
+        painter.setRenderHint(QPainter::Antialiasing);
+        painter.setTransform(viewport.transform());
+        QRect exposed_bounds = viewport.to_world(exposed.boundingRect());
+        exposed_shapes.clear();
+        for (Shape* shape : shapes_container.selected()) {
+            if (shape->get_bounds().intersects(exposed_bounds)) {
+                exposed_shapes.push_back(shape);
+            }
         }
+        batcher.draw(painter, exposed_shapes);
+        profile_count(ProfileCounter::ShapesDrawn, exposed_shapes.size());
     }
 
-    // Draw selected shapes on top
-    for (Shape* shape : shapes_container.get_all()) {
-        if (shape->get_selected()) {
-            shape->draw(painter);
+    if (region_dragging) {
+        painter.setTransform(QTransform());
+        painter.setPen(QPen(Qt::darkGray, 1, Qt::DashLine));
+        painter.setBrush(Qt::NoBrush);
+        if (selection_tool == SelectionTool::Lasso) {
+            painter.drawPolygon(viewport.transform().map(lasso.get_points()));
+        }
+        else {
+            painter.drawRect(viewport.to_screen(band_rect));
         }
     }
+
+    if (profiler_overlay) {
+        painter.setTransform(QTransform());
+        draw_profiler_overlay(painter);
+    }
+    if (Profiler::enabled()) {
+        Profiler::instance().end_frame();
+    }
+}
+
+void CanvasWidget::draw_profiler_overlay(QPainter& painter) {
+    const Profiler& profiler = Profiler::instance();
+    QRect area = profiler_overlay_rect();
+    painter.setRenderHint(QPainter::Antialiasing, false);
+    painter.fillRect(area, QColor(0, 0, 0, 170));
+    painter.setPen(Qt::white);
+    painter.setFont(QFont("monospace", 8));
+
+    QString frame = QString("frame %1  drawn %2  hit %3  moved %4  damage %5")
+        .arg(profiler.frames())
+        .arg(profiler.last_frame(ProfileCounter::ShapesDrawn))
+        .arg(profiler.last_frame(ProfileCounter::ShapesHit))
+        .arg(profiler.last_frame(ProfileCounter::ShapesTransformed))
+        .arg(profiler.last_frame(ProfileCounter::DamageRects));
+    int line_height = painter.fontMetrics().height();
+    int y = area.top() + line_height;
+    painter.drawText(area.left() + 6, y, frame);
+
+    for (size_t zone = 0; zone < size_t(ProfileZone::Count); ++zone) {
+        const Profiler::ZoneStats& stats = profiler.stats(ProfileZone(zone));
+        y += line_height;
+        QString line = QString("%1 last %2  p50 %3  p95 %4  max %5 ms")
+            .arg(QString::fromLatin1(profile_zone_names[zone].data(), int(profile_zone_names[zone].size())), -9)
+            .arg(double(stats.last_ns) / 1e6, 0, 'f', 2)
+            .arg(stats.calls ? stats.percentile_ms(0.5) : 0.0, 0, 'f', 2)
+            .arg(stats.calls ? stats.percentile_ms(0.95) : 0.0, 0, 'f', 2)
+            .arg(double(stats.max_ns) / 1e6, 0, 'f', 2);
+        painter.drawText(area.left() + 6, y, line);
+    }
 }
 
 void CanvasWidget::mousePressEvent(QMouseEvent* event) {
-    if (event->button() == Qt::LeftButton) {
-        int x = event->pos().x();
-        int y = event->pos().y();
+    apply_pending_input();
+    ProfileScope scope(ProfileZone::HitTest);
+    // A document being loaded can be panned but not edited
+    if (event->button() == Qt::MiddleButton) {
+        panning = true;
+        pan_anchor = event->pos();
+    }
+    else if (event->button() == Qt::LeftButton && !is_loading()) {
+        history.break_merging();
+        QPoint point = viewport.to_world(event->pos());
+        int x = point.x();
+        int y = point.y();
 
         // Find all shapes at click point
-        std::vector<Shape*> shapes_at_point;
-        for (Shape* shape : shapes_container.get_all()) {
-            if (shape->contains(event->pos())) {
-                shapes_at_point.push_back(shape);
-            }
+        shapes_at_point.clear();
+        shapes_container.shapes_at(point, shapes_at_point);
+        profile_count(ProfileCounter::ShapesHit, shapes_at_point.size());
+
+        if (shapes_at_point.empty() && selection_tool != SelectionTool::None) {
+            // Start a rubber band or lasso; the selection follows the drag
+            region_dragging = true;
+            region_modifiers = event->modifiers();
+            base_selection = shapes_container.get_selection().data();
+            band_origin = point;
+            band_rect = QRect(point, point);
+            lasso.clear();
+            lasso.add_point(point);
+            update_region_selection();
+            update(region_overlay());
         }
-
-        if (!shapes_at_point.empty()) {
+        else if (!shapes_at_point.empty()) {
             // Ctrl+click - toggle selection
             if (event->modifiers() & Qt::ControlModifier) {
                 for (Shape* shape : shapes_at_point) {
                     shape->set_selected(!shape->get_selected());
+                    damage_static(shape);
                 }
             }
             else {
                 // Regular click - deselect all and select shapes at point
-                for (Shape* shape : shapes_container.get_all()) {
-                    shape->set_selected(false);
-                }
+                previous_selection = shapes_container.get_selection().data();
+                shapes_container.set_all_selected(false);
                 for (Shape* shape : shapes_at_point) {
                     shape->set_selected(true);
                 }
+                damage_selection_change();
             }
 
-            std::vector<QString> selected_types;
+            LogEvent action = (event->modifiers() & Qt::ControlModifier) ?
+                LogEvent::Toggled : LogEvent::Selected;
+            bool first = true;
             for (Shape* shape : shapes_at_point) {
-                selected_types.push_back(Shape::get_shape_type_name(shape));
-            }
-
-            QString action = (event->modifiers() & Qt::ControlModifier) ?
-                "toggled" : "selected";
-            std::cout << "Selection " << action.toStdString() << " for shapes: ";
-            for (size_t i = 0; i < selected_types.size(); ++i) {
-                std::cout << selected_types[i].toStdString();
-                if (i < selected_types.size() - 1) std::cout << ", ";
+                log_event(LogLevel::Info, action, shape->get_kind(), 0, 0, 0, 0, first);
+                first = false;
             }
-            std::cout << std::endl;
         }
         else {
             // Click on empty space - deselect all
-            for (Shape* shape : shapes_container.get_all()) {
-                shape->set_selected(false);
-            }
-            std::cout << "Deselected all shapes" << std::endl;
+            previous_selection = shapes_container.get_selection().data();
+            shapes_container.set_all_selected(false);
+            damage_selection_change();
+            log_event(LogLevel::Info, LogEvent::Deselected);
 
             // Create new shape if type is selected
-            if (!current_shape_type.isEmpty()) {
-                Shape* new_shape = nullptr;
-
-                if (current_shape_type == "rectangle") {
-                    new_shape = new Rectangle(x, y);
-                }
-                else if (current_shape_type == "circle") {
-                    new_shape = new Circle(x, y);
-                }
-                else if (current_shape_type == "square") {
-                    new_shape = new Square(x, y);
-                }
-                else if (current_shape_type == "ellipse") {
-                    new_shape = new Ellipse(x, y);
-                }
-                else if (current_shape_type == "triangle") {
-                    new_shape = new Triangle(x, y);
-                }
-                else if (current_shape_type == "line") {
-                    new_shape = new Line(x, y);
-                }
-
-                if (new_shape) {
-                    shapes_container.add(new_shape);
-                    std::cout << "Created shape "
-                        << Shape::get_shape_type_name(new_shape).toStdString()
-                        << " at position (" << x << ", " << y
-                        << ") with size (" << new_shape->get_width() << ", "
-                        << new_shape->get_height() << ")" << std::endl;
-                }
+            Shape* new_shape = shapes_container.create(current_shape_kind, x, y, canvas_size());
+            if (new_shape) {
+                damage_static(new_shape);
+                log_event(LogLevel::Info, LogEvent::Created, new_shape->get_kind(),
+                    new_shape->get_x(), new_shape->get_y(), new_shape->get_width(), new_shape->get_height());
+
+                EditCommand command(EditCommand::Create);
+                command.ids.push_back(new_shape->get_id());
+                command.records.push_back(ShapeRecord::of(new_shape));
+                command.positions.push_back(quint32(new_shape->get_slot()));
+                history.push(std::move(command));
             }
         }
 
-        update();
+        flush_damage();
     }
 }
 
-void CanvasWidget::keyPressEvent(QKeyEvent* event) {
-    if (event->key() == Qt::Key_Delete) {
-        shapes_container.clear_selected();
-        update();
+void CanvasWidget::mouseMoveEvent(QMouseEvent* event) {
+    if (panning) {
+        viewport.pan(event->pos() - pan_anchor);
+        pan_anchor = event->pos();
+        invalidate();
+    }
+    else if (region_dragging) {
+        ProfileScope scope(ProfileZone::HitTest);
+        QRect old_overlay = region_overlay();
+        QPoint point = viewport.to_world(event->pos());
+        if (selection_tool == SelectionTool::Lasso) {
+            lasso.add_point(point);
+        }
+        else {
+            band_rect = QRect(band_origin, point).normalized();
+        }
+        update_region_selection();
+        update(old_overlay | region_overlay());
+        flush_damage();
     }
-    else if (event->key() == Qt::Key_Left || event->key() == Qt::Key_Right ||
-        event->key() == Qt::Key_Up || event->key() == Qt::Key_Down) {
+}
 
-        if (event->modifiers() & Qt::ShiftModifier) {
-            // Resize with Shift
-            int dw = 0, dh = 0;
-            if (event->key() == Qt::Key_Left) dw = -5;
-            else if (event->key() == Qt::Key_Right) dw = 5;
-            else if (event->key() == Qt::Key_Up) dh = -5;
-            else if (event->key() == Qt::Key_Down) dh = 5;
+void CanvasWidget::mouseReleaseEvent(QMouseEvent* event) {
+    if (event->button() == Qt::MiddleButton) {
+        panning = false;
+    }
+    else if (event->button() == Qt::LeftButton && region_dragging) {
+        region_dragging = false;
+        update(region_overlay());
+        log_event(LogLevel::Info, LogEvent::RegionSelected, ShapeKind::Unknown,
+            int(shapes_container.selected_count()), selection_tool == SelectionTool::Lasso);
+    }
+}
 
-            for (Shape* shape : shapes_container.get_all()) {
-                if (shape->get_selected()) {
-                    shape->resize(dw, dh, width(), height());
-                }
-            }
-            update();
+void CanvasWidget::wheelEvent(QWheelEvent* event) {
+    QPoint steps = event->angleDelta();
+    if (event->modifiers() & Qt::ControlModifier) {
+        // Ctrl+wheel zooms around the cursor, 2x per four notches
+        viewport.zoom_at(event->position().toPoint(), std::pow(2.0, steps.y() / 480.0));
+    }
+    else {
+        viewport.pan(steps / 4);
+    }
+    invalidate();
+    event->accept();
+}
+
+void CanvasWidget::keyPressEvent(QKeyEvent* event) {
+    if (is_loading()) return;
+
+    int key = event->key();
+    if (key == Qt::Key_Left || key == Qt::Key_Right || key == Qt::Key_Up || key == Qt::Key_Down) {
+        // Move, or resize with Shift; applied with the rest of the frame's presses
+        bool resizing = event->modifiers() & Qt::ShiftModifier;
+        if (!pending_steps.empty() && resizing != pending_resizing) {
+            apply_pending_input();
         }
-        else {
-            // Move without Shift
-            int dx = 0, dy = 0;
-            if (event->key() == Qt::Key_Left) dx = -5;
-            else if (event->key() == Qt::Key_Right) dx = 5;
-            else if (event->key() == Qt::Key_Up) dy = -5;
-            else if (event->key() == Qt::Key_Down) dy = 5;
-
-            for (Shape* shape : shapes_container.get_all()) {
-                if (shape->get_selected()) {
-                    shape->move(dx, dy, width(), height());
-                }
-            }
-            update();
+        pending_resizing = resizing;
+        pending_steps.push_back(QPoint(key == Qt::Key_Left ? -5 : key == Qt::Key_Right ? 5 : 0,
+            key == Qt::Key_Up ? -5 : key == Qt::Key_Down ? 5 : 0));
+        schedule_input();
+        return;
+    }
+
+    apply_pending_input();
+    drop_stale_copies();
+    if (key == Qt::Key_Delete) {
+        ProfileScope scope(ProfileZone::Transform);
+        EditCommand command(EditCommand::Delete);
+        for (Shape* shape : shapes_container.selected()) {
+            damage(shape);
         }
+        shapes_container.clear_selected(&command);
+        flush_damage();
+        if (!command.ids.empty()) history.push(std::move(command));
     }
 }
 
 void CanvasWidget::resizeEvent(QResizeEvent* event) {
-    QSize old_size = event->oldSize();
-    QSize new_size = event->size();
-    std::cout << "Canvas changed from " << old_size.width() << "x" << old_size.height()
-        << " to " << new_size.width() << "x" << new_size.height() << std::endl;
-
     QWidget::resizeEvent(event);
 
-    for (Shape* shape : shapes_container.get_all()) {
-        shape->adjust_to_bounds(width(), height());
+    // Dragging the window edge resizes many times per frame; shapes are
+    // pulled into the canvas once, from the first old size to the latest one
+    if (!canvas_resize_pending) {
+        canvas_resize_pending = true;
+        resize_from = event->oldSize();
     }
-    update();
+    static_damage = QRegion(rect());
+    schedule_input();
+}
+
+int CanvasWidget::frame_interval() const {
+    qreal rate = screen() ? screen()->refreshRate() : 0.0;
+    return std::max(1, qRound(1000.0 / (rate > 0 ? rate : 60.0)));
+}
+
+void CanvasWidget::schedule_input() {
+    // Input after an idle frame is applied at once; input that arrives while
+    // the last frame's work was still running waits for the next frame
+    int interval = frame_interval();
+    qint64 elapsed = since_last_frame.isValid() ? since_last_frame.elapsed() : interval;
+    if (elapsed >= interval) {
+        apply_pending_input();
+    }
+    else if (!frame_timer.isActive()) {
+        frame_timer.start(int(interval - elapsed));
+    }
+}
+
+void CanvasWidget::apply_pending_input() {
+    frame_timer.stop();
+    if (!has_pending_input()) return;
+    if (canvas_resize_pending) {
+        apply_canvas_resize();
+        update();
+    }
+
+    QPoint total;
+    for (const QPoint& step : pending_steps) total += step;
+    if (!total.isNull()) {
+        ProfileScope scope(ProfileZone::Transform);
+        drop_stale_copies();
+        for (Shape* shape : shapes_container.selected()) {
+            damage(shape);
+        }
+        if (!apply_selection_delta(total) && pending_steps.size() > 1) {
+            // Part of the burst would leave the canvas: replay it press by press
+            for (const QPoint& step : pending_steps) {
+                apply_selection_delta(step);
+            }
+        }
+        flush_damage();
+    }
+    pending_steps.clear();
+
+    // Measured from the end, so a slow frame makes the next presses coalesce
+    since_last_frame.start();
+}
+
+bool CanvasWidget::apply_selection_delta(const QPoint& delta) {
+    QSize bounds = canvas_size();
+    bool applied = pending_resizing ?
+        shapes_container.resize_selected(delta.x(), delta.y(), bounds.width(), bounds.height(), &workers) :
+        shapes_container.translate_selected(delta.x(), delta.y(), bounds.width(), bounds.height(), &workers);
+    if (!applied) return false;
+
+    // All-or-nothing: the ids are always the whole selection
+    EditCommand command(pending_resizing ? EditCommand::Resize : EditCommand::Move);
+    command.dx = delta.x();
+    command.dy = delta.y();
+    command.selection = shapes_container.get_selection_generation();
+    for (Shape* shape : shapes_container.selected()) {
+        damage(shape);
+        command.ids.push_back(shape->get_id());
+    }
+    profile_count(ProfileCounter::ShapesTransformed, command.ids.size());
+    history.push(std::move(command));
+    return true;
+}
+
+void CanvasWidget::apply_canvas_resize() {
+    ProfileScope scope(ProfileZone::Resize);
+    canvas_resize_pending = false;
+    log_event(LogLevel::Info, LogEvent::CanvasResized, ShapeKind::Unknown,
+        resize_from.width(), resize_from.height(), width(), height());
+
+    EditCommand command(EditCommand::Adjust);
+    shapes_container.adjust_to_bounds(canvas_size().width(), canvas_size().height(), &command);
+    profile_count(ProfileCounter::ShapesTransformed, command.ids.size());
+    if (!command.ids.empty()) history.push(std::move(command));
+    static_damage = QRegion(rect());
 }
 
 void CanvasWidget::set_current_shape_type(const QString& shape_type) {
-    current_shape_type = shape_type;
+    current_shape_kind = Shape::kind_from_id(shape_type);
+    if (shape_type == "select") selection_tool = SelectionTool::Band;
+    else if (shape_type == "lasso") selection_tool = SelectionTool::Lasso;
+    else selection_tool = SelectionTool::None;
 }
 
 void CanvasWidget::change_selected_shapes_color(const QColor& color) {
-    std::vector<QString> changed_types;
-    for (Shape* shape : shapes_container.get_all()) {
-        if (shape->get_selected()) {
-            shape->set_color(color);
-            changed_types.push_back(Shape::get_shape_type_name(shape));
+    apply_pending_input();
+    SelectedShapesView to_change = shapes_container.selected();
+    if (to_change.empty()) return;
+
+    drop_stale_copies();
+    EditCommand command(EditCommand::Recolor);
+    command.new_color = color.rgba();
+    for (Shape* shape : to_change) {
+        command.ids.push_back(shape->get_id());
+        command.old_colors.push_back(shape->get_color().rgba());
+        damage(shape);
+    }
+    shapes_container.recolor_selected(color, &workers);
+    flush_damage();
+    history.push(std::move(command));
+}
+
+QImage CanvasWidget::render_to_image(int thread_count) const {
+    TiledRenderer renderer(thread_count);
+    return renderer.render(shapes_container, canvas_size(), Qt::white);
+}
+
+bool CanvasWidget::save_document(const QString& path) const {
+    if (loading_document) return false;
+    return ShapeDocument::save(shapes_container, path);
+}
+
+bool CanvasWidget::load_document(const QString& path) {
+    load_timer.stop();
+    loading_document.reset();
+    pending_steps.clear();
+    shapes_container.clear();
+    history.clear();
+    viewport.reset();
+
+    std::unique_ptr<ShapeDocument> document(new ShapeDocument());
+    if (!document->open(path)) {
+        // Files that cannot be mapped are streamed chunk by chunk
+        bool loaded = ShapeDocument::import(path, shapes_container);
+        document_size = QSize();
+        for (const Shape* shape : shapes_container) {
+            document_size = document_size.expandedTo(QSize(shape->get_x() + shape->get_width(),
+                shape->get_y() + shape->get_height()));
         }
+        invalidate();
+        return loaded;
     }
 
-    if (!changed_types.empty()) {
-        std::cout << "Changed color for shapes: ";
-        for (size_t i = 0; i < changed_types.size(); ++i) {
-            std::cout << changed_types[i].toStdString();
-            if (i < changed_types.size() - 1) std::cout << ", ";
+    // The mapped records are on screen before a single shape is built; shapes
+    // outside the window stay put and are reached by panning
+    document_size = document->extent();
+    shapes_container.reserve(document->size());
+    loading_document = std::move(document);
+    loading_next = 0;
+    invalidate();
+    load_timer.start();
+    return true;
+}
+
+void CanvasWidget::load_step() {
+    QElapsedTimer elapsed;
+    elapsed.start();
+    const ShapeDocument& document = *loading_document;
+    while (loading_next < document.size()) {
+        // The clock is read once per block of records, not per shape
+        size_t block_end = std::min(document.size(), loading_next + 4096);
+        for (; loading_next < block_end; ++loading_next) {
+            const ShapeRecord& record = document[loading_next];
+            if (record.is_valid()) shapes_container.create(record);
         }
-        std::cout << " to " << color.name().toStdString() << std::endl;
+        if (elapsed.elapsed() >= LOAD_STEP_BUDGET_MS) return;
+    }
+
+    load_timer.stop();
+    loading_document.reset();
+    invalidate();
+}
+
+void CanvasWidget::finish_loading() {
+    while (loading_document) load_step();
+}
+
+void CanvasWidget::select_all() {
+    apply_pending_input();
+    // Every shape is drawn by the overlay over its copy in the cached layer
+    shapes_container.set_all_selected(true);
+    stale_static = rect();
+    update();
+}
+
+void CanvasWidget::set_profiler_overlay(bool visible) {
+    profiler_overlay = visible;
+    Profiler::instance().set_enabled(visible);
+    update(profiler_overlay_rect());
+}
+
+void CanvasWidget::zoom_in() {
+    viewport.zoom_at(rect().center(), 2.0);
+    invalidate();
+}
+
+void CanvasWidget::zoom_out() {
+    viewport.zoom_at(rect().center(), 0.5);
+    invalidate();
+}
+
+void CanvasWidget::reset_view() {
+    viewport.reset();
+    invalidate();
+}
+
+void CanvasWidget::undo() {
+    apply_pending_input();
+    // Undone shapes may be selected or not, so both layers are repainted
+    if (history.undo(shapes_container, [this](const Shape* shape) { damage_static(shape); })) {
+        flush_damage();
+    }
+}
+
+void CanvasWidget::redo() {
+    apply_pending_input();
+    if (history.redo(shapes_container, [this](const Shape* shape) { damage_static(shape); })) {
+        flush_damage();
     }
 }
 
@@ -537,11 +3214,62 @@ void ShapeEditor::create_menu() {
     connect(triangle_action, &QAction::triggered, this, [this]() { set_shape_type("triangle"); });
     connect(line_action, &QAction::triggered, this, [this]() { set_shape_type("line"); });
 
+    // Edit menu
+    QMenu* edit_menu = menu_bar->addMenu("Edit");
+    QAction* undo_action = new QAction("Undo", this);
+    undo_action->setShortcut(QKeySequence::Undo);
+    connect(undo_action, &QAction::triggered, canvas, &CanvasWidget::undo);
+    edit_menu->addAction(undo_action);
+    QAction* redo_action = new QAction("Redo", this);
+    redo_action->setShortcut(QKeySequence("Ctrl+Y"));
+    connect(redo_action, &QAction::triggered, canvas, &CanvasWidget::redo);
+    edit_menu->addAction(redo_action);
+    QAction* select_all_action = new QAction("Select all", this);
+    select_all_action->setShortcut(QKeySequence::SelectAll);
+    connect(select_all_action, &QAction::triggered, canvas, &CanvasWidget::select_all);
+    edit_menu->addAction(select_all_action);
+
+    // View menu
+    QMenu* view_menu = menu_bar->addMenu("View");
+    QAction* zoom_in_action = new QAction("Zoom in", this);
+    zoom_in_action->setShortcut(QKeySequence::ZoomIn);
+    connect(zoom_in_action, &QAction::triggered, canvas, &CanvasWidget::zoom_in);
+    view_menu->addAction(zoom_in_action);
+    QAction* zoom_out_action = new QAction("Zoom out", this);
+    zoom_out_action->setShortcut(QKeySequence::ZoomOut);
+    connect(zoom_out_action, &QAction::triggered, canvas, &CanvasWidget::zoom_out);
+    view_menu->addAction(zoom_out_action);
+    QAction* reset_view_action = new QAction("Actual size", this);
+    reset_view_action->setShortcut(QKeySequence("Ctrl+0"));
+    connect(reset_view_action, &QAction::triggered, canvas, &CanvasWidget::reset_view);
+    view_menu->addAction(reset_view_action);
+    view_menu->addSeparator();
+    QAction* profiler_action = new QAction("Profiler overlay", this);
+    profiler_action->setCheckable(true);
+    profiler_action->setShortcut(QKeySequence("F12"));
+    connect(profiler_action, &QAction::toggled, canvas, &CanvasWidget::set_profiler_overlay);
+    view_menu->addAction(profiler_action);
+
     // Color menu
     QMenu* color_menu = menu_bar->addMenu("Color");
     QAction* change_color_action = new QAction("Change selected color", this);
     connect(change_color_action, &QAction::triggered, this, &ShapeEditor::change_color);
     color_menu->addAction(change_color_action);
+
+    // File menu
+    QMenu* file_menu = menu_bar->addMenu("File");
+    QAction* open_action = new QAction("Open...", this);
+    connect(open_action, &QAction::triggered, this, &ShapeEditor::open_document);
+    file_menu->addAction(open_action);
+    QAction* save_action = new QAction("Save...", this);
+    connect(save_action, &QAction::triggered, this, &ShapeEditor::save_document);
+    file_menu->addAction(save_action);
+    QAction* export_action = new QAction("Export image...", this);
+    connect(export_action, &QAction::triggered, this, &ShapeEditor::export_image);
+    file_menu->addAction(export_action);
+    QAction* trace_action = new QAction("Export profiler trace...", this);
+    connect(trace_action, &QAction::triggered, this, &ShapeEditor::export_trace);
+    file_menu->addAction(trace_action);
 }
 
 void ShapeEditor::create_toolbar() {
@@ -554,7 +3282,9 @@ void ShapeEditor::create_toolbar() {
         {"Square", "square"},
         {"Ellipse", "ellipse"},
         {"Triangle", "triangle"},
-        {"Line", "line"}
+        {"Line", "line"},
+        {"Select", "select"},
+        {"Lasso", "lasso"}
     };
 
     for (const auto& [text, shape_type] : shape_actions) {
@@ -566,13 +3296,61 @@ void ShapeEditor::create_toolbar() {
 
 void ShapeEditor::set_shape_type(const QString& shape_type) {
     canvas->set_current_shape_type(shape_type);
-    std::cout << "Selected shape: " << shape_type.toStdString() << std::endl;
+    ShapeLog::instance().write_text(LogLevel::Info, "Selected shape: " + shape_type.toStdString());
+}
+
+void ShapeEditor::export_image() {
+    QString path = QFileDialog::getSaveFileName(this, "Export image", "", "PNG images (*.png)");
+    if (path.isEmpty()) return;
+
+    QImage image = canvas->render_to_image();
+    if (image.save(path)) {
+        ShapeLog::instance().write_text(LogLevel::Info, "Exported canvas to " + path.toStdString());
+    }
+    else {
+        ShapeLog::instance().write_text(LogLevel::Warning, "Failed to export canvas to " + path.toStdString());
+    }
+}
+
+void ShapeEditor::save_document() {
+    QString path = QFileDialog::getSaveFileName(this, "Save drawing", "", "Shape drawings (*.shpd)");
+    if (path.isEmpty()) return;
+
+    if (canvas->save_document(path)) {
+        ShapeLog::instance().write_text(LogLevel::Info, "Saved drawing to " + path.toStdString());
+    }
+    else {
+        ShapeLog::instance().write_text(LogLevel::Warning, "Failed to save drawing to " + path.toStdString());
+    }
+}
+
+void ShapeEditor::open_document() {
+    QString path = QFileDialog::getOpenFileName(this, "Open drawing", "", "Shape drawings (*.shpd)");
+    if (path.isEmpty()) return;
+
+    if (canvas->load_document(path)) {
+        ShapeLog::instance().write_text(LogLevel::Info, "Opened drawing " + path.toStdString());
+    }
+    else {
+        ShapeLog::instance().write_text(LogLevel::Warning, "Failed to open drawing " + path.toStdString());
+    }
+}
+
+void ShapeEditor::export_trace() {
+    QString path = QFileDialog::getSaveFileName(this, "Export profiler trace", "", "Chrome traces (*.json)");
+    if (path.isEmpty()) return;
+
+    if (Profiler::instance().export_chrome_trace(path)) {
+        ShapeLog::instance().write_text(LogLevel::Info, "Exported profiler trace to " + path.toStdString());
+    }
+    else {
+        ShapeLog::instance().write_text(LogLevel::Warning, "Failed to export profiler trace to " + path.toStdString());
+    }
 }
 
 void ShapeEditor::change_color() {
     QColor color = QColorDialog::getColor();
     if (color.isValid()) {
         canvas->change_selected_shapes_color(color);
-        canvas->update();
     }
 }
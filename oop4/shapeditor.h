@@ -7,45 +7,614 @@
 #include <QColor>
 #include <QPoint>
 #include <QPolygon>
+#include <QRegion>
+#include <QImage>
+#include <QFont>
+#include <QFontMetrics>
+#include <QTransform>
+#include <QLine>
+#include <QPainterPath>
 #include <QKeyEvent>
+#include <QKeySequence>
 #include <QMouseEvent>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QScreen>
+#include <QWheelEvent>
 #include <QMenuBar>
 #include <QToolBar>
 #include <QAction>
 #include <QColorDialog>
+#include <QFileDialog>
+#include <QFile>
+#include <QSaveFile>
 #include <QString>
 #include <vector>
+#include <string_view>
+#include <unordered_map>
 #include <memory>
 #include <algorithm>
 #include <iostream>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <deque>
+#include <chrono>
+#include <cstdlib>
+#include <cstddef>
+#include <cmath>
+#include <new>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+class Shape;
+
+// Uniform grid over shape bounding boxes, narrows hit-testing to nearby shapes.
+// Every bucket entry knows which of its shape's cells it is and the shape keeps
+// its position in each bucket, so removal is O(1) per cell. Shapes spanning
+// more than MAX_SHAPE_CELLS cells go to a separate list instead.
+class SpatialGrid {
+public:
+    static const int CELL_SIZE = 64;
+    static const int MAX_SHAPE_CELLS = 4;
+
+    void insert(Shape* shape, const QRect& bounds);
+    // bounds must be the ones the shape was inserted with
+    void remove(Shape* shape, const QRect& bounds);
+    void update(Shape* shape, const QRect& old_bounds, const QRect& new_bounds);
+    void clear() { cells.clear(); large.clear(); }
+    // Both queries also report every shape of the large list
+    void query(const QPoint& point, std::vector<Shape*>& out) const;
+    // May report a shape once per overlapped cell
+    void query(const QRect& rect, std::vector<Shape*>& out) const;
+    size_t cell_count() const { return cells.size(); }
+    static qint64 cells_spanned(const QRect& rect);
+    // True if both bounds cover the same cells, so update() has nothing to do
+    static bool same_cells(const QRect& a, const QRect& b);
+
+private:
+    struct Entry {
+        Shape* shape;
+        quint32 cell; // which of the shape's cells this is, in row-major order
+    };
+    using Bucket = std::vector<Entry>;
+
+    static int cell_coord(int value);
+    static quint64 cell_key(int cell_x, int cell_y);
+    static void append(const Bucket& bucket, std::vector<Shape*>& out);
+    // Swap-and-pop; the entry moved into position is told its new place
+    static void erase(Bucket& bucket, quint32 position);
+
+    std::unordered_map<quint64, Bucket> cells;
+    Bucket large;
+};
+
+class ShapesContainer;
+struct ShapeRecord;
+struct EditCommand;
+class WorkerPool;
+
+// Type tag stored in every Shape and alongside the geometry arrays
+enum class ShapeKind : quint8 {
+    Circle,
+    Rectangle,
+    Square,
+    Ellipse,
+    Triangle,
+    Line,
+    Unknown
+};
+
+// Display names and toolbar ids, indexed by ShapeKind
+inline constexpr std::string_view shape_kind_names[] = {
+    "Circle", "Rectangle", "Square", "Ellipse", "Triangle", "Line", "Unknown"
+};
+inline constexpr std::string_view shape_kind_ids[] = {
+    "circle", "rectangle", "square", "ellipse", "triangle", "line", ""
+};
+
+enum class LogLevel : quint8 {
+    Debug,
+    Info,
+    Warning,
+    Off
+};
+
+enum class LogEvent : quint8 {
+    Moved,          // a, b -> c, d: old and new position
+    MoveBlocked,
+    Resized,        // a, b -> c, d: old and new size
+    ResizeBlocked,  // a, b: requested dw, dh
+    Adjusted,       // a, b -> c, d: old and new position
+    Created,        // a, b: position, c, d: size
+    Deleted,
+    Selected,
+    Toggled,
+    Deselected,
+    ColorChanged,   // a: new color as RGBA
+    CanvasResized,  // a, b -> c, d: old and new size
+    SelectionDeleted,  // a: shape count
+    ShapesAdjusted, // a: shape count, b, c: new canvas size
+    SelectionMoved,    // a: shape count, b, c: dx, dy
+    SelectionResized,  // a: shape count, b, c: dw, dh
+    SelectionBlocked,  // a: shape count, b, c: requested delta
+    SelectionRecolored, // a: new color as RGBA, b: shape count
+    Undone,         // a: EditCommand::Type, b: shape count
+    Redone,         // a: EditCommand::Type, b: shape count
+    RegionSelected, // a: selected shape count, b: 1 for a lasso, 0 for a rubber band
+    Text            // next entry of the text queue
+};
+
+// Fixed-size record; hot paths only fill one of these, the writer thread formats it
+struct LogRecord {
+    LogEvent event;
+    LogLevel level;
+    ShapeKind kind;
+    bool starts_list; // first shape of a Deleted/Selected/Toggled/ColorChanged list
+    int a, b, c, d;
+};
+
+// Asynchronous log sink: producers push records into a lock-free ring buffer,
+// a background thread drains it and coalesces runs of the same event
+// ("Adjusted 48,213 shapes when canvas resized") before writing to std::cout
+class ShapeLog {
+public:
+    static const size_t CAPACITY = 1 << 16;
+    // Runs longer than this are printed as a single summary line
+    static const size_t COALESCE_LIMIT = 8;
+
+    static ShapeLog& instance();
+    ~ShapeLog();
+
+    void set_level(LogLevel level) { min_level.store(level, std::memory_order_relaxed); }
+    LogLevel get_level() const { return min_level.load(std::memory_order_relaxed); }
+    bool enabled(LogLevel level) const { return level >= get_level() && level != LogLevel::Off; }
+
+    void write(LogLevel level, LogEvent event, ShapeKind kind = ShapeKind::Unknown,
+        int a = 0, int b = 0, int c = 0, int d = 0, bool starts_list = false);
+    void write_text(LogLevel level, const std::string& text);
+    // Blocks until everything written so far has reached std::cout
+    void flush();
+
+private:
+    ShapeLog();
+
+    struct Cell {
+        std::atomic<size_t> sequence;
+        LogRecord record;
+    };
+
+    bool try_push(const LogRecord& record);
+    bool try_pop(LogRecord& record);
+    void writer_loop();
+    void consume(const LogRecord& record);
+    void flush_run();
+    void print(const LogRecord& record);
+
+    std::atomic<LogLevel> min_level;
+    std::unique_ptr<Cell[]> cells;
+    std::atomic<size_t> enqueue_pos;
+    std::atomic<size_t> dequeue_pos;
+    std::atomic<size_t> dropped;
+    std::atomic<size_t> flushed_pos; // records up to here have reached std::cout
+    std::atomic<bool> stopping;
+
+    std::mutex text_mutex;
+    std::deque<std::string> texts;
+
+    // Writer thread state
+    std::vector<LogRecord> run;
+    size_t run_length;
+    std::thread writer;
+};
+
+inline void log_event(LogLevel level, LogEvent event, ShapeKind kind = ShapeKind::Unknown,
+    int a = 0, int b = 0, int c = 0, int d = 0, bool starts_list = false) {
+    ShapeLog& log = ShapeLog::instance();
+    if (log.enabled(level)) {
+        log.write(level, event, kind, a, b, c, d, starts_list);
+    }
+}
+
+// Instrumented hot paths and the counters they feed, indexed like the name tables
+enum class ProfileZone : quint8 {
+    Paint,      // paintEvent
+    HitTest,    // mousePressEvent and region drags
+    Transform,  // keyPressEvent edits, one per frame for coalesced arrow keys
+    Resize,     // bounds adjustment after resizeEvent, one per frame
+    Count
+};
+
+enum class ProfileCounter : quint8 {
+    ShapesDrawn,
+    ShapesHit,
+    ShapesTransformed,
+    DamageRects,
+    Count
+};
+
+inline constexpr std::string_view profile_zone_names[] = { "paint", "hit_test", "transform", "resize" };
+inline constexpr std::string_view profile_counter_names[] = {
+    "shapes_drawn", "shapes_hit", "shapes_transformed", "damage_rects"
+};
+
+// Latency histograms, per-frame counters and a Chrome trace of the editor's
+// hot paths. Probes only touch it after checking enabled(), so a disabled
+// profiler costs one well-predicted branch per probe. GUI thread only.
+class Profiler {
+public:
+    // Bucket b holds latencies in [2^b, 2^(b+1)) microseconds, bucket 0 everything below 2 us
+    static const int HISTOGRAM_BUCKETS = 24;
+    // Trace events beyond this are dropped until the trace is cleared
+    static const size_t MAX_TRACE_EVENTS = size_t(1) << 20;
+
+    struct ZoneStats {
+        quint64 calls = 0;
+        quint64 total_ns = 0;
+        quint64 max_ns = 0;
+        quint64 last_ns = 0;
+        quint64 histogram[HISTOGRAM_BUCKETS] = {};
+
+        // Upper bound of the bucket holding the given fraction of calls
+        double percentile_ms(double fraction) const;
+    };
+
+    static Profiler& instance();
+    static bool enabled() { return active.load(std::memory_order_relaxed); }
+    static quint64 now();
+
+    void set_enabled(bool enable) { active.store(enable, std::memory_order_relaxed); }
+    void record(ProfileZone zone, quint64 start_ns, quint64 duration_ns);
+    void count(ProfileCounter counter, quint64 amount) { frame_counters[size_t(counter)] += amount; }
+    // Closes the current frame: its counters become last_frame() and go to the trace
+    void end_frame();
+
+    const ZoneStats& stats(ProfileZone zone) const { return zones[size_t(zone)]; }
+    quint64 last_frame(ProfileCounter counter) const { return frame_totals[size_t(counter)]; }
+    quint64 frames() const { return frame_count; }
+    void reset();
+
+    // Trace Event Format, loadable in chrome://tracing and Perfetto
+    bool export_chrome_trace(const QString& path) const;
+
+private:
+    Profiler();
+
+    struct TraceEvent {
+        quint64 start_ns;
+        quint64 duration_ns;      // counter snapshots: 0
+        qint32 zone;              // -1 for a counter snapshot
+        quint32 counters_index;   // counter snapshots: first entry in trace_counters
+    };
+
+    static inline std::atomic<bool> active{ false };
+
+    quint64 epoch_ns;
+    ZoneStats zones[size_t(ProfileZone::Count)];
+    quint64 frame_counters[size_t(ProfileCounter::Count)] = {};
+    quint64 frame_totals[size_t(ProfileCounter::Count)] = {};
+    quint64 frame_count;
+    std::vector<TraceEvent> trace;
+    std::vector<quint64> trace_counters;
+};
+
+// Times the enclosing block into a zone when profiling is on
+class ProfileScope {
+public:
+    // Disabled cost: one relaxed load here and a test of the cached flag on exit
+    explicit ProfileScope(ProfileZone zone) : zone(zone), active(Profiler::enabled()), start(0) {
+        if (active) start = Profiler::now();
+    }
+    ~ProfileScope() {
+        if (active) Profiler::instance().record(zone, start, Profiler::now() - start);
+    }
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+    ProfileZone zone;
+    bool active; // profiling was on when the scope opened
+    quint64 start;
+};
+
+inline void profile_count(ProfileCounter counter, quint64 amount = 1) {
+    if (Profiler::enabled()) Profiler::instance().count(counter, amount);
+}
+
+inline int lowest_set_bit(quint64 word) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return int(index);
+#else
+    return __builtin_ctzll(word);
+#endif
+}
+
+// Dense selection bitset, bit i is the shape in slot i. Bulk operations work a
+// 64-bit word at a time and take masks in the layout of ShapesContainer::hit_test.
+// Bits past size() are always zero.
+class SelectionSet {
+public:
+    size_t size() const { return bit_count; }
+    bool test(size_t index) const { return (words[index >> 6] >> (index & 63)) & 1; }
+    void set(size_t index, bool value) {
+        quint64 bit = quint64(1) << (index & 63);
+        if (value) words[index >> 6] |= bit;
+        else words[index >> 6] &= ~bit;
+    }
+
+    void push_back(bool value);
+    void pop_back();
+    // New bits are cleared
+    void resize(size_t count);
+    void reserve(size_t count) { words.reserve((count + 63) / 64); }
+    void clear();
+
+    void fill(bool value);
+    size_t count() const;
+    bool any() const;
+    // First set bit at or after index, size() if there is none
+    size_t next_set(size_t index) const;
+    template<class F> void for_each_set(F f) const {
+        for (size_t w = 0; w < words.size(); ++w) {
+            for (quint64 word = words[w]; word; word &= word - 1) {
+                f((w << 6) + size_t(lowest_set_bit(word)));
+            }
+        }
+    }
+
+    // mask must cover size() bits; extra bits are ignored
+    void assign(const std::vector<quint64>& mask);
+    void unite(const std::vector<quint64>& mask);
+    void intersect(const std::vector<quint64>& mask);
+    void toggle(const std::vector<quint64>& mask);
+
+    const std::vector<quint64>& data() const { return words; }
+
+private:
+    void clear_tail();
+
+    std::vector<quint64> words;
+    size_t bit_count = 0;
+};
+
+// Closed freehand selection polygon in world coordinates. Edges are bucketed
+// into horizontal bands, so point and edge queries only visit nearby edges.
+class LassoRegion {
+public:
+    static const int BAND_HEIGHT = 32;
+
+    void clear();
+    // Appends a vertex; the polygon is always closed back to the first one
+    void add_point(const QPoint& point);
+    const QPolygon& get_points() const { return points; }
+    QRect bounds() const { return bounding; }
+
+    // Even-odd rule
+    bool contains(const QPoint& point) const;
+    // Calls f(a, b) for the edges that may reach rows [top, bottom], the closing
+    // edge included, until f returns true. An edge can be visited more than once.
+    template<class F> bool any_edge(int top, int bottom, F f) const {
+        if (points.isEmpty()) return false;
+        if (f(points.back(), points.front())) return true;
+        int first = std::max(band_of(top) - first_band, 0);
+        int last = std::min(band_of(bottom) - first_band, int(bands.size()) - 1);
+        for (int band = first; band <= last; ++band) {
+            for (int edge : bands[size_t(band)]) {
+                if (f(points[edge], points[edge + 1])) return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    static int band_of(int y);
+
+    QPolygon points;
+    QRect bounding;
+    int first_band = 0;
+    std::vector<std::vector<int>> bands; // from first_band down; edge i runs from points[i] to points[i + 1]
+};
+
+// Read-only view over the selected shapes of a container, iterates in place
+class SelectedShapesView {
+public:
+    class iterator {
+    public:
+        iterator(const ShapesContainer* container, size_t index) : container(container), index(index) { skip(); }
+        Shape* operator*() const;
+        iterator& operator++() { ++index; skip(); return *this; }
+        bool operator!=(const iterator& other) const { return index != other.index; }
+        bool operator==(const iterator& other) const { return index == other.index; }
+
+    private:
+        void skip();
+
+        const ShapesContainer* container;
+        size_t index;
+    };
+
+    explicit SelectedShapesView(const ShapesContainer* container) : container(container) {}
+    iterator begin() const;
+    iterator end() const;
+    bool empty() const { return !(begin() != end()); }
+
+private:
+    const ShapesContainer* container;
+};
+
+// Implementations of ShapesContainer::hit_test; Auto is the widest one the CPU runs
+enum class HitTestIsa : quint8 { Auto, Scalar, Sse2, Avx2 };
+
+// Stable shape handle: survives slot changes, never reused for another shape
+using ShapeId = quint32;
+
+// Slab allocator for shapes with one free list per concrete type. Memory is
+// carved from fixed-size chunks and only handed back to the system by clear().
+class ShapePool {
+public:
+    static const size_t CHUNK_SHAPES = 1024;
+
+    ShapePool() = default;
+    ShapePool(const ShapePool&) = delete;
+    ShapePool& operator=(const ShapePool&) = delete;
+    ~ShapePool() { clear(); }
+
+    Shape* create(ShapeKind kind, int x, int y);
+    // Runs the destructor and puts the memory back on the type's free list
+    void destroy(Shape* shape);
+    // Releases every chunk at once; all shapes must already be destroyed
+    void clear();
+
+private:
+    struct FreeSlot {
+        FreeSlot* next;
+    };
+
+    struct Slab {
+        std::vector<char*> chunks;
+        size_t used_in_last_chunk = CHUNK_SHAPES;
+        FreeSlot* free_list = nullptr;
+    };
+
+    Slab slabs[size_t(ShapeKind::Unknown)];
+};
 
 // Shape container class
+// Geometry, type tags and selection flags live in parallel arrays indexed by
+// each shape's slot; Shape objects read and write through them once added.
 class ShapesContainer {
+    friend class Shape;
+    friend class SelectedShapesView;
+
 private:
-    std::vector<class Shape*> shapes;
+    std::vector<Shape*> shapes;
+    std::vector<int> xs, ys;
+    std::vector<int> widths, heights;
+    std::vector<ShapeKind> kinds;
+    SelectionSet selection;
+    std::vector<Shape*> by_id; // ShapeId -> shape, nullptr once removed
+    quint64 selection_generation = 0;
+    SpatialGrid grid;
+    ShapePool pool;
+    mutable std::vector<Shape*> query_buffer; // reused between hit-tests
+    std::vector<size_t> selected_slots;       // reused between bulk edits
+
+    QRect bounds_of(size_t slot) const;
+    void set_geometry(size_t slot, int x, int y, int w, int h);
+    void attach(Shape* shape, ShapeId id);
+    void destroy(Shape* shape);
+    void move_slot(size_t from, size_t to);
+    void pop_slot();
+    void truncate(size_t count);
+    void collect_selected_slots();
+    void update_grid_for_selected(int dx, int dy, int dw, int dh, WorkerPool* pool);
+    template<class Test> void region_hit_test(const QRect& area, std::vector<quint64>& mask, Test touches) const;
 
 public:
+    // Takes ownership of a heap-allocated shape
     void add(Shape* shape);
+    // Creates a shape in the container's pool, moved inside bounds if they are
+    // given
+    Shape* create(ShapeKind kind, int x, int y, const QSize& bounds = QSize());
+    Shape* create(const ShapeRecord& record);
+    // Brings back removed shapes under their old ids at their old places in
+    // drawing order, in one pass; positions are ascending. Ids in use are skipped.
+    void restore(const std::vector<ShapeId>& ids, const std::vector<ShapeRecord>& records,
+        const std::vector<quint32>& positions, std::vector<Shape*>& restored);
+    // O(1): the last shape takes over the removed shape's slot, and with it that
+    // place in drawing order. clear_selected() keeps the order of the others.
     void remove(Shape* shape);
-    std::vector<Shape*> get_all() const;
-    void clear_selected();
+    // Removes shapes sorted by slot in one pass, keeping the order of the others
+    void remove_ordered(const std::vector<Shape*>& removed);
+    // Destroys every shape; ids are not reused afterwards
+    void clear();
+    void reserve(size_t count);
+    Shape* find(ShapeId id) const { return id < by_id.size() ? by_id[id] : nullptr; }
+    const std::vector<Shape*>& get_all() const { return shapes; }
+    std::vector<Shape*>::const_iterator begin() const { return shapes.begin(); }
+    std::vector<Shape*>::const_iterator end() const { return shapes.end(); }
+    SelectedShapesView selected() const { return SelectedShapesView(this); }
+    // Changes whenever shapes are selected, deselected, added or removed
+    quint64 get_selection_generation() const { return selection_generation; }
+    void shapes_at(const QPoint& point, std::vector<Shape*>& out) const;
+    // Shapes whose bounds intersect rect, in drawing order
+    void shapes_in(const QRect& rect, std::vector<Shape*>& out) const;
+
+    // Batched containment test over every shape; sets bit `slot` of mask for each
+    // shape containing the point (or any of the points)
+    void hit_test(const QPoint& point, std::vector<quint64>& mask) const;
+    void hit_test(const std::vector<QPoint>& points, std::vector<quint64>& mask) const;
+    // Kernel used by hit_test in every container, for tests and benchmarks;
+    // false if this build or CPU has no such kernel. Not thread-safe.
+    static bool use_hit_test_isa(HitTestIsa isa);
+
+    // Same mask layout for region selection: shapes whose exact geometry touches
+    // the rectangle or the lasso. Candidates come from the grid, or from a scan
+    // of the arrays when the region covers most of the drawing.
+    void region_hit_test(const QRect& rect, std::vector<quint64>& mask) const;
+    void region_hit_test(const LassoRegion& lasso, std::vector<quint64>& mask) const;
+
+    // Deleted shapes are appended to changes (ids, records and positions) when it is given
+    void clear_selected(EditCommand* changes = nullptr);
+
+    const SelectionSet& get_selection() const { return selection; }
+    size_t selected_count() const { return selection.count(); }
+    void set_all_selected(bool selected) { selection.fill(selected); ++selection_generation; }
+    // Set operations with a hit_test mask, e.g. toggle_selection for Ctrl+click
+    void select_only(const std::vector<quint64>& mask) { selection.assign(mask); ++selection_generation; }
+    void add_to_selection(const std::vector<quint64>& mask) { selection.unite(mask); ++selection_generation; }
+    void intersect_selection(const std::vector<quint64>& mask) { selection.intersect(mask); ++selection_generation; }
+    void toggle_selection(const std::vector<quint64>& mask) { selection.toggle(mask); ++selection_generation; }
+
+    // Bulk edits of the selection over the geometry arrays, split across pool
+    // when one is given. translate/resize are all-or-nothing: if any selected
+    // shape would leave the canvas or collapse, nothing changes and false is
+    // returned. Each call logs a single record.
+    bool translate_selected(int dx, int dy, int canvas_width, int canvas_height, WorkerPool* pool = nullptr);
+    bool resize_selected(int dw, int dh, int canvas_width, int canvas_height, WorkerPool* pool = nullptr);
+    void recolor_selected(const QColor& color, WorkerPool* pool = nullptr);
+
+    // Moved shapes are appended to changes (ids and offsets) when it is given
+    void adjust_to_bounds(int canvas_width, int canvas_height, EditCommand* changes = nullptr);
     size_t size() const;
     ~ShapesContainer();
 };
 
 // Base Shape class
 class Shape {
+    friend class ShapesContainer;
+    friend class SpatialGrid;
+
 protected:
+    // Used until the shape is added to a container, which then owns the values
     int x, y;
     int width, height;
+    bool is_selected;
+
     QColor color;
     QColor selection_color;
     int line_width;
     int selection_line_width;
-    bool is_selected;
+    const ShapeKind kind;
+    ShapesContainer* owner;
+    size_t slot;
+    ShapeId id;
+    bool pooled; // memory belongs to the owner's ShapePool
+    quint32 grid_entries[SpatialGrid::MAX_SHAPE_CELLS]; // position in each grid bucket
 
 public:
-    Shape(int x, int y);
+    // Margin around x/y/width/height covering selection outlines and Line hit tolerance
+    static const int BOUNDS_MARGIN = 5;
+
+    Shape(int x, int y, ShapeKind kind);
     virtual ~Shape() = default;
 
     virtual void draw(QPainter& painter) = 0;
@@ -56,25 +625,66 @@ public:
 
     // Getters and setters
     void set_color(const QColor& color) { this->color = color; }
-    void set_selected(bool selected) { is_selected = selected; }
-    bool get_selected() const { return is_selected; }
+    void set_selection_color(const QColor& color) { selection_color = color; }
+    void set_line_width(int width) { line_width = width; }
+    void set_selection_line_width(int width) { selection_line_width = width; }
+    void set_selected(bool selected) {
+        if (!owner) is_selected = selected;
+        else if (owner->selection.test(slot) != selected) {
+            owner->selection.set(slot, selected);
+            ++owner->selection_generation;
+        }
+    }
+    bool get_selected() const { return owner ? owner->selection.test(slot) : is_selected; }
     QColor get_color() const { return color; }
+    QColor get_selection_color() const { return selection_color; }
+    int get_line_width() const { return line_width; }
+    int get_selection_line_width() const { return selection_line_width; }
+    ShapeKind get_kind() const { return kind; }
+    ShapeId get_id() const { return id; }
+    // Position in the container's drawing order
+    size_t get_slot() const { return slot; }
 
     // New getters for width and height
-    int get_width() const { return width; }
-    int get_height() const { return height; }
-    int get_x() const { return x; }
-    int get_y() const { return y; }
+    int get_width() const { return owner ? owner->widths[slot] : width; }
+    int get_height() const { return owner ? owner->heights[slot] : height; }
+    int get_x() const { return owner ? owner->xs[slot] : x; }
+    int get_y() const { return owner ? owner->ys[slot] : y; }
 
     // New setters for width and height
-    void set_width(int w) { width = w; }
-    void set_height(int h) { height = h; }
-    void set_x(int x) { this->x = x; }
-    void set_y(int y) { this->y = y; }
+    void set_width(int w) { set_geometry(get_x(), get_y(), w, get_height()); }
+    void set_height(int h) { set_geometry(get_x(), get_y(), get_width(), h); }
+    void set_x(int x) { set_geometry(x, get_y(), get_width(), get_height()); }
+    void set_y(int y) { set_geometry(get_x(), y, get_width(), get_height()); }
+    void set_geometry(int x, int y, int w, int h);
 
-    static QString get_shape_type_name(const Shape* shape);
+    QRect get_bounds() const;
+
+    static std::string_view get_shape_type_name(const Shape* shape) {
+        return shape_kind_names[size_t(shape->kind)];
+    }
+    // Toolbar id ("rectangle", ...) to kind, Unknown if there is no such shape
+    static ShapeKind kind_from_id(const QString& id);
+    // New shape of the given kind at (x, y), nullptr for Unknown
+    static Shape* create(ShapeKind kind, int x, int y);
 };
 
+inline Shape* SelectedShapesView::iterator::operator*() const {
+    return container->shapes[index];
+}
+
+inline void SelectedShapesView::iterator::skip() {
+    index = container->selection.next_set(index);
+}
+
+inline SelectedShapesView::iterator SelectedShapesView::begin() const {
+    return iterator(container, 0);
+}
+
+inline SelectedShapesView::iterator SelectedShapesView::end() const {
+    return iterator(container, container->shapes.size());
+}
+
 // Derived shape classes
 class Circle : public Shape {
 public:
@@ -118,17 +728,348 @@ public:
     bool contains(const QPoint& point) const override;
 };
 
+// Drawing file format ("SHPD"): a header followed by one fixed-size record per
+// shape in host byte order (little-endian on every supported target), so a
+// mapped file can be drawn without parsing
+struct ShapeFileHeader {
+    char magic[4];
+    quint16 version;
+    quint16 record_size;
+    quint64 count;
+};
+
+struct ShapeRecord {
+    static const quint8 SELECTED = 1;
+    // Geometry a record may carry; larger values would overflow the bounds
+    // arithmetic or spread one shape over millions of grid cells
+    static const qint32 MAX_COORDINATE = 1 << 24;
+    static const qint32 MAX_EXTENT = 1 << 14;
+
+    quint8 kind; // ShapeKind
+    quint8 flags;
+    quint8 line_width;
+    quint8 selection_line_width;
+    qint32 x, y;
+    qint32 width, height;
+    quint32 color; // QRgb
+    quint32 selection_color;
+    quint32 reserved;
+
+    // Known kind and geometry within the limits above; files may carry anything
+    bool is_valid() const;
+    static ShapeRecord of(const Shape* shape);
+    // Copies the record's state into a shape that is not in a container yet
+    void apply_to(Shape* shape) const;
+};
+
+static_assert(sizeof(ShapeFileHeader) == 16, "ShapeFileHeader layout is part of the file format");
+static_assert(sizeof(ShapeRecord) == 32, "ShapeRecord layout is part of the file format");
+
+// Read-only view of a drawing file mapped into memory
+class ShapeDocument {
+public:
+    static const quint16 VERSION = 1;
+    // Records read or written per I/O call when streaming
+    static constexpr size_t STREAM_CHUNK_RECORDS = 65536;
+
+    ShapeDocument() : mapped(nullptr), records(nullptr), count(0) {}
+    ShapeDocument(const ShapeDocument&) = delete;
+    ShapeDocument& operator=(const ShapeDocument&) = delete;
+    ~ShapeDocument() { close(); }
+
+    bool open(const QString& path);
+    void close();
+    bool is_open() const { return mapped != nullptr; }
+
+    size_t size() const { return count; }
+    const ShapeRecord* data() const { return records; }
+    const ShapeRecord& operator[](size_t index) const { return records[index]; }
+    // Union of the valid records' shapes, from the origin
+    QSize extent() const;
+
+    static bool save(const ShapesContainer& container, const QString& path);
+    // Streams the file into the container chunk by chunk, so documents larger
+    // than memory can be imported; a non-null viewport keeps only the shapes
+    // that intersect it. Invalid records are skipped. Returns false if the
+    // file is missing or malformed.
+    static bool import(const QString& path, ShapesContainer& container, const QRect& viewport = QRect());
+
+private:
+    static bool check_header(const ShapeFileHeader& header, qint64 file_size);
+
+    QFile file;
+    uchar* mapped;
+    const ShapeRecord* records;
+    size_t count;
+};
+
+// Reversible edit. Only deltas are kept, except for created and deleted
+// shapes, whose full records are needed to bring them back.
+struct EditCommand {
+    enum Type : quint8 { Create, Delete, Move, Resize, Recolor, Adjust };
+
+    Type type;
+    int dx, dy;                       // Move, Resize: applied to every id
+    quint64 selection;                // Move, Resize: selection generation if the ids are
+                                      // the whole selection, 0 otherwise
+    QRgb new_color;                   // Recolor
+    std::vector<ShapeId> ids;
+    std::vector<QRgb> old_colors;     // Recolor: one per id
+    std::vector<QPoint> offsets;      // Adjust: one per id
+    std::vector<ShapeRecord> records; // Create, Delete: one per id
+    std::vector<quint32> positions;   // Create, Delete: slot in drawing order, ascending
+
+    explicit EditCommand(Type type) : type(type), dx(0), dy(0), selection(0), new_color(0) {}
+    size_t memory_size() const;
+};
+
+// Undo/redo stacks with a memory budget; the oldest commands are dropped
+// once the budget is exceeded
+class EditHistory {
+public:
+    static const size_t DEFAULT_MEMORY_LIMIT = size_t(64) << 20;
+
+    explicit EditHistory(size_t memory_limit = DEFAULT_MEMORY_LIMIT)
+        : memory_limit(memory_limit), memory_used(0), can_merge(false) {}
+
+    // Records an edit that has already been applied and clears the redo stack.
+    // A Move or Resize of a whole selection right after another one of the same
+    // selection (same generation, never 0) is merged into it.
+    void push(EditCommand command);
+    // Next push starts a new command even if it could be merged
+    void break_merging() { can_merge = false; }
+
+    // touched is called for every affected shape before and after the change
+    bool undo(ShapesContainer& container, const std::function<void(const Shape*)>& touched);
+    bool redo(ShapesContainer& container, const std::function<void(const Shape*)>& touched);
+    bool can_undo() const { return !done.empty(); }
+    bool can_redo() const { return !undone.empty(); }
+
+    void clear();
+    size_t memory() const { return memory_used; }
+
+private:
+    void apply(EditCommand& command, bool forward, ShapesContainer& container,
+        const std::function<void(const Shape*)>& touched);
+    void trim();
+
+    std::deque<EditCommand> done;
+    std::vector<EditCommand> undone;
+    size_t memory_limit;
+    size_t memory_used;
+    bool can_merge;
+};
+
+// Draws many shapes with one pen change per (kind, color, line width) group,
+// submitting each group through drawRects/drawLines or a single path.
+// Shapes are regrouped only within a band: a run in drawing order in which
+// shapes of different groups never share a BAND_CELL cell. Outlines of one
+// group look the same in any order, so overlapping shapes keep their z-order.
+class ShapeBatcher {
+public:
+    // Maximum number of shapes merged into one QPainterPath before it is flushed
+    static const int MAX_PATH_SHAPES = 4096;
+    static const int BAND_CELL = 32;
+    // Shapes covering more cells than this are drawn in a band of their own
+    static const int MAX_BAND_CELLS = 256;
+    ShapeBatcher();
+
+    // Draws every shape, then the selection outlines of the selected ones
+    void draw(QPainter& painter, const std::vector<Shape*>& shapes);
+    // Same for document records, skipping those outside clip (null clip draws all)
+    void draw(QPainter& painter, const ShapeRecord* records, size_t count, const QRect& clip = QRect());
+
+private:
+    // The key holds everything needed to set the pen, so items only carry geometry
+    struct Item {
+        quint64 key;
+        int x, y, width, height;
+    };
+
+    // Cell of the band occupancy table, valid while band matches the current one
+    struct BandCell {
+        quint32 band;
+        quint64 key;
+    };
+    static const size_t BAND_SLOTS = 8192; // power of two, collisions only end bands early
+
+    static quint64 make_key(ShapeKind kind, const QColor& color, int line_width);
+    static QPen pen_of(quint64 key);
+    // Marks the cells of item for the current band, false if one is taken by another key
+    bool claim(const Item& item);
+    // Level of detail: shapes smaller than a pixel at the painter's scale are
+    // drawn as one point in their color, grouped under ShapeKind::Unknown
+    static quint64 key_at_scale(ShapeKind kind, const QColor& color, int line_width, int width, int height, qreal scale);
+    void draw_groups(QPainter& painter, bool outlines);
+    void draw_band(QPainter& painter, size_t first, size_t last, bool outlines);
+    void submit(QPainter& painter, ShapeKind kind, size_t first, size_t last, bool outlines);
+
+    std::vector<Item> items;
+    std::vector<BandCell> band_cells;
+    quint32 band;
+    std::vector<QRect> rects;
+    std::vector<QLine> lines;
+    std::vector<QPoint> points;
+};
+
+// Fixed set of worker threads; the calling thread joins in while it waits
+class WorkerPool {
+public:
+    // 0 means one thread per hardware core
+    explicit WorkerPool(int thread_count = 0);
+    ~WorkerPool();
+
+    int thread_count() const { return int(threads.size()) + 1; }
+    // Runs job(i) for every i in [0, count), indices are handed out dynamically
+    void parallel_for(size_t count, const std::function<void(size_t)>& job);
+
+private:
+    void worker_loop();
+    void run_jobs();
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    const std::function<void(size_t)>* job;
+    std::atomic<size_t> next_index;
+    size_t job_count;
+    int busy_workers;
+    quint64 generation;
+    bool stopping;
+};
+
+// Rasterizes a whole drawing tile by tile on a worker pool, for export and
+// canvases too large to draw on the GUI thread
+class TiledRenderer {
+public:
+    static constexpr int TILE_SIZE = 256;
+
+    explicit TiledRenderer(int thread_count = 0) : pool(thread_count) {}
+    int thread_count() const { return pool.thread_count(); }
+    QImage render(const ShapesContainer& container, const QSize& size, const QColor& background);
+
+private:
+    WorkerPool pool;
+};
+
+// Maps world (document) coordinates to widget pixels: screen = (world - origin) * zoom
+class Viewport {
+public:
+    static constexpr double MIN_ZOOM = 1.0 / 256;
+    static constexpr double MAX_ZOOM = 64.0;
+
+    double get_zoom() const { return zoom; }
+    QPointF get_origin() const { return origin; }
+    QTransform transform() const { return QTransform(zoom, 0, 0, zoom, -origin.x() * zoom, -origin.y() * zoom); }
+
+    QPoint to_world(const QPoint& screen) const;
+    // Smallest world rect covering the screen rect
+    QRect to_world(const QRect& screen) const;
+    // Smallest screen rect covering the world rect
+    QRect to_screen(const QRect& world) const;
+
+    // Keeps the world point under anchor in place
+    void zoom_at(const QPoint& anchor, double factor);
+    void pan(const QPoint& screen_delta);
+    void reset() { zoom = 1.0; origin = QPointF(); }
+
+private:
+    double zoom = 1.0;
+    QPointF origin;
+};
+
 // Canvas widget
 class CanvasWidget : public QWidget {
     Q_OBJECT
 
 private:
     ShapesContainer shapes_container;
-    QString current_shape_type;
+    ShapeKind current_shape_kind;
+    std::vector<Shape*> shapes_at_point; // reused between clicks
+    std::vector<Shape*> exposed_shapes;  // reused between paints
+
+    // Damaged areas collected during an edit, repainted by flush_damage()
+    static const int MAX_DAMAGE_RECTS = 64;
+    QRegion damage_region;
+    int damage_rect_count;
+
+    // Unselected shapes are rasterized once into static_layer; only the parts
+    // in static_damage are redrawn, selected shapes are composited every frame
+    QImage static_layer;
+    QRegion static_damage;
+    // Shapes selected since they were last drawn into static_layer keep their
+    // unselected copy there, covered by the overlay, until they change
+    QRect stale_static;
+    std::vector<quint64> previous_selection; // selection before the current click
+    ShapeBatcher batcher;
+    EditHistory history;
+    WorkerPool workers; // bulk edits of large selections
+
+    // A document being loaded stays mapped and is drawn from its records while
+    // load_step() builds its shapes, LOAD_STEP_BUDGET_MS per event loop pass
+    static const int LOAD_STEP_BUDGET_MS = 8;
+    std::unique_ptr<ShapeDocument> loading_document;
+    size_t loading_next;
+    QTimer load_timer;
+
+    // Rubber-band and lasso selection; a drag starts on empty space while the
+    // Select or Lasso tool is active
+    enum class SelectionTool : quint8 { None, Band, Lasso };
+    SelectionTool selection_tool;
+    bool region_dragging;
+    Qt::KeyboardModifiers region_modifiers; // Shift adds, Ctrl toggles
+    QPoint band_origin;
+    QRect band_rect;
+    LassoRegion lasso;
+    std::vector<quint64> base_selection;     // selection when the drag started
+    std::vector<quint64> region_hits;        // reused between mouse moves
+
+    // Only shapes intersecting the visible world rect are submitted for drawing
+    Viewport viewport;
+    QSize document_size; // extent of the loaded drawing in world coordinates
+    QPoint pan_anchor;   // last cursor position of a middle-button drag
+    bool panning;
+
+    bool profiler_overlay;
+
+    // Arrow keys and resizes only record what changed; apply_pending_input()
+    // turns everything that arrived within a frame into one bulk edit and one
+    // repaint, so auto-repeat cannot queue up full passes over the drawing
+    QTimer frame_timer;
+    QElapsedTimer since_last_frame;
+    std::vector<QPoint> pending_steps; // one per arrow key press, in order
+    bool pending_resizing;             // the steps are Shift+arrow resizes
+    bool canvas_resize_pending;
+    QSize resize_from;
+
+    int frame_interval() const;
+    void schedule_input();
+    bool apply_selection_delta(const QPoint& delta);
+    void apply_canvas_resize();
+
+    // World rect shapes are kept in, whatever the zoom: the window at actual
+    // size grown to cover the loaded drawing. New shapes are clamped into it.
+    QSize canvas_size() const { return size().expandedTo(document_size); }
+    QRect screen_bounds(const Shape* shape) const;
+    QRect profiler_overlay_rect() const { return QRect(8, 8, 360, 150); }
+    void draw_profiler_overlay(QPainter& painter);
+    QRect region_overlay() const;
+    void update_region_selection();
+    void damage(const Shape* shape);
+    void damage_static(const Shape* shape);
+    void damage_selection_change();
+    void drop_stale_copies();
+    void flush_damage();
+    void refresh_static_layer();
+    void load_step();
 
 protected:
     void paintEvent(QPaintEvent* event) override;
     void mousePressEvent(QMouseEvent* event) override;
+    void mouseMoveEvent(QMouseEvent* event) override;
+    void mouseReleaseEvent(QMouseEvent* event) override;
+    void wheelEvent(QWheelEvent* event) override;
     void keyPressEvent(QKeyEvent* event) override;
     void resizeEvent(QResizeEvent* event) override;
 
@@ -136,8 +1077,31 @@ public:
     CanvasWidget(QWidget* parent = nullptr);
     void set_current_shape_type(const QString& shape_type);
     void change_selected_shapes_color(const QColor& color);
+    QImage render_to_image(int thread_count = 0) const;
+    // Fails while a document is being loaded
+    bool save_document(const QString& path) const;
+    // Mapped files are shown at once and their shapes built in steps, input is
+    // ignored meanwhile; other files are streamed in before returning
+    bool load_document(const QString& path);
+    bool is_loading() const { return loading_document != nullptr; }
+    // Builds the remaining shapes of a document being loaded right away
+    void finish_loading();
+    // Rebuilds the cached layer and repaints the whole canvas
+    void invalidate();
+    bool has_pending_input() const { return !pending_steps.empty() || canvas_resize_pending; }
+    // Applies coalesced input now instead of at the next frame
+    void apply_pending_input();
+    // Turns the profiler on together with its on-canvas statistics
+    void set_profiler_overlay(bool visible);
+    void select_all();
+    void undo();
+    void redo();
+    void zoom_in();
+    void zoom_out();
+    void reset_view();
 
     ShapesContainer& get_shapes_container() { return shapes_container; }
+    const EditHistory& get_history() const { return history; }
 };
 
 // Main window
@@ -153,6 +1117,10 @@ private:
 private slots:
     void set_shape_type(const QString& shape_type);
     void change_color();
+    void export_image();
+    void save_document();
+    void open_document();
+    void export_trace();
 
 public:
     ShapeEditor(QWidget* parent = nullptr);